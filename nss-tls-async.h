@@ -0,0 +1,77 @@
+/*
+ * This file is part of nss-tls.
+ *
+ * Copyright (C) 2018, 2019, 2020  Dima Krasner
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef _NSS_TLS_ASYNC_H_INCLUDED
+#define _NSS_TLS_ASYNC_H_INCLUDED
+
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * non-blocking lookups for event loops: nss_tls_async_submit() starts a
+ * lookup and returns immediately, the descriptor returned by
+ * nss_tls_async_fd() becomes readable when lookups complete or time out and
+ * nss_tls_async_reap() returns completed lookups, in any order; a context
+ * must not be used by multiple threads at once
+ */
+struct nss_tls_async;
+
+struct nss_tls_async_result {
+    uint64_t id;
+    int error; /* 0, ENOENT if the name does not exist, ETIMEDOUT or EIO */
+    int af;
+    char cname[NS_MAXDNAME];
+    uint8_t count;
+    union {
+        struct in_addr in;
+        struct in6_addr in6;
+    } addrs[16];
+};
+
+struct nss_tls_async *nss_tls_async_new(void);
+void nss_tls_async_free(struct nss_tls_async *ctx);
+
+int nss_tls_async_fd(const struct nss_tls_async *ctx);
+
+/*
+ * returns 0 on success or -1 and sets errno; EAGAIN means nss-tlsd is busy
+ * (e.g. its listening socket backlog is full) and the caller should retry
+ * later, for example after reaping some lookups
+ */
+int nss_tls_async_submit(struct nss_tls_async *ctx,
+                         const char *name,
+                         int af,
+                         uint64_t id);
+
+/* returns the number of completed lookups, up to max, or -1 on error */
+int nss_tls_async_reap(struct nss_tls_async *ctx,
+                       struct nss_tls_async_result *results,
+                       int max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
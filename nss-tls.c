@@ -18,7 +18,12 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
  */
 
+#define _GNU_SOURCE
+/* the latency of each lookup is measured only while it's traced */
+#define _SDT_HAS_SEMAPHORES 1
+
 #include <stdlib.h>
+#include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -30,31 +35,715 @@
 #include <nss.h>
 #include <pthread.h>
 #include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/auxv.h>
+#include <ctype.h>
 
 #include "nss-tls.h"
+#include "nss-tls-async.h"
+
+#define CACHE_MAX 1024
+#define FILTER_CHECK_INTERVAL 1000000
+#define STATS_BUCKETS 32
+
+#ifdef NSS_TLS_USDT
+NSS_TLS_PROBE_SEMAPHORE(client_start);
+NSS_TLS_PROBE_SEMAPHORE(client_end);
+#endif
+
+/*
+ * an optional, per-process cache of responses, enabled by setting
+ * NSS_TLS_CACHE to the number of entries; each name can be stored in one slot,
+ * so a new name replaces the one that occupies its slot
+ */
+struct cache_entry {
+    int af;
+    char name[NS_MAXDNAME];
+    struct nss_tls_res res;
+};
+
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_entry *cache;
+static size_t cache_size;
+
+static pthread_once_t filter_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t filter_lock = PTHREAD_MUTEX_INITIALIZER;
+static const struct nss_tls_filter *filter;
+static int filter_fd = -1;
+static int64_t filter_checked;
+
+/*
+ * optional, per-process lookup statistics, enabled by setting NSS_TLS_STATS to
+ * a file they're appended to when the process exits; each thread counts its
+ * own lookups, so lookups never wait for each other, and the counters of
+ * threads that exit are kept for the report
+ */
+enum outcome {
+    OUTCOME_SUCCESS,
+    OUTCOME_NOTFOUND,
+    OUTCOME_TIMEOUT,
+    OUTCOME_CONNECT,
+    OUTCOME_ERANGE,
+    OUTCOME_OTHER,
+    OUTCOME_MAX
+};
+
+static const char *outcome_names[OUTCOME_MAX] = {
+    "success",
+    "notfound",
+    "timeout",
+    "connect-fail",
+    "erange",
+    "other"
+};
+
+/* bucket i counts lookups that took less than 2^i microseconds */
+struct stats {
+    struct stats *next;
+    uint64_t counts[OUTCOME_MAX][STATS_BUCKETS];
+    uint64_t total[OUTCOME_MAX];
+    uint64_t max[OUTCOME_MAX];
+};
+
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static const char *stats_path;
+static struct stats *all_stats;
+static __thread struct stats *thread_stats;
 
 static void cleanup(void *arg)
 {
     close((int)(intptr_t)arg);
 }
 
-enum nss_status _nss_tls_gethostbyname2_r(const char *name,
-                                          int af,
-                                          struct hostent *ret,
-                                          char *buf,
-                                          size_t buflen,
-                                          int *errnop,
-                                          int *h_errnop)
+static void lock_cache(void)
+{
+    pthread_mutex_lock(&cache_lock);
+}
+
+static void unlock_cache(void)
+{
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static void init_cache(void)
+{
+    const char *size;
+    long n;
+
+    size = secure_getenv("NSS_TLS_CACHE");
+    if (!size)
+        return;
+
+    n = strtol(size, NULL, 10);
+    if (n <= 0)
+        return;
+    if (n > CACHE_MAX)
+        n = CACHE_MAX;
+
+    cache = calloc((size_t)n, sizeof(cache[0]));
+    if (!cache)
+        return;
+
+    /* a child process must not inherit the lock held by another thread */
+    if (pthread_atfork(lock_cache, unlock_cache, unlock_cache) != 0) {
+        free(cache);
+        cache = NULL;
+        return;
+    }
+
+    cache_size = (size_t)n;
+}
+
+static struct cache_entry *get_cache_entry(const char *name, int af)
+{
+    uint32_t hash = 2166136261u ^ (uint32_t)af;
+
+    for (; *name; ++name)
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+
+    return &cache[hash % cache_size];
+}
+
+/* expiry times are in microseconds, from CLOCK_MONOTONIC */
+static int64_t get_time(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int query_cache(struct nss_tls_data *data)
+{
+    struct cache_entry *entry;
+    int found = 0;
+
+    pthread_once(&cache_once, init_cache);
+    if (!cache)
+        return 0;
+
+    lock_cache();
+
+    entry = get_cache_entry(data->req.name, data->req.af);
+    if ((entry->af == data->req.af) &&
+        (strcmp(entry->name, data->req.name) == 0) &&
+        (entry->res.expiry > get_time())) {
+        memcpy(&data->res, &entry->res, sizeof(data->res));
+        found = 1;
+    }
+
+    unlock_cache();
+    return found;
+}
+
+static void add_to_cache(const struct nss_tls_data *data)
+{
+    struct cache_entry *entry;
+
+    if (!cache || (data->res.expiry <= 0))
+        return;
+
+    lock_cache();
+
+    entry = get_cache_entry(data->req.name, data->req.af);
+    entry->af = data->req.af;
+    strcpy(entry->name, data->req.name);
+    memcpy(&entry->res, &data->res, sizeof(entry->res));
+
+    unlock_cache();
+}
+
+static enum nss_status fill_hostent(struct nss_tls_data *data,
+                                    int af,
+                                    struct hostent *ret,
+                                    int *errnop,
+                                    int *h_errnop)
+{
+    int i;
+    uint8_t count;
+
+    if (data->res.cname[0]) {
+        ret->h_name = data->res.cname;
+        data->aliases[0] = data->req.name;
+        data->aliases[1] = NULL;
+    } else {
+        ret->h_name = data->req.name;
+        data->aliases[0] = NULL;
+    }
+    ret->h_aliases = data->aliases;
+    ret->h_addrtype = af;
+    data->addrs[0] = NULL;
+    ret->h_addr_list = data->addrs;
+
+    count = data->res.count;
+    if (count == 0) {
+        *h_errnop = HOST_NOT_FOUND;
+        return NSS_STATUS_NOTFOUND;
+    }
+    if (count > NSS_TLS_ADDRS_MAX)
+        count = NSS_TLS_ADDRS_MAX;
+
+    switch (af) {
+    case AF_INET:
+        ret->h_length = sizeof(struct in_addr);
+        break;
+
+    case AF_INET6:
+        ret->h_length = sizeof(struct in6_addr);
+        break;
+
+    default:
+        return NSS_STATUS_NOTFOUND;
+    }
+
+    for (i = 0; i < count; ++i)
+        data->addrs[i] = (char *)&data->res.addrs[i];
+    data->addrs[i] = NULL;
+
+    *errnop = 0;
+    return NSS_STATUS_SUCCESS;
+}
+
+/*
+ * root uses the system nss-tlsd instance, while other users prefer their own
+ * instance
+ */
+static int get_socket_path(struct sockaddr_un *sun)
+{
+    const char *dir;
+    size_t len;
+
+    if (geteuid() == 0)
+        strcpy(sun->sun_path, NSS_TLS_SOCKET_PATH);
+    else {
+        dir = getenv("XDG_RUNTIME_DIR");
+        if (dir) {
+            len = strlen(dir);
+            if (len > sizeof(sun->sun_path) - sizeof("/"NSS_TLS_SOCKET_NAME))
+                return -1;
+
+            memcpy(sun->sun_path, dir, len);
+            sun->sun_path[len] = '/';
+            ++len;
+            strncpy(sun->sun_path + len,
+                    NSS_TLS_SOCKET_NAME,
+                    sizeof(sun->sun_path) - len);
+            sun->sun_path[sizeof(sun->sun_path) - 1] = '\0';
+        } else
+            strcpy(sun->sun_path, NSS_TLS_SOCKET_PATH);
+    }
+
+    return 0;
+}
+
+static void lock_filter(void)
+{
+    pthread_mutex_lock(&filter_lock);
+}
+
+static void unlock_filter(void)
+{
+    pthread_mutex_unlock(&filter_lock);
+}
+
+static void init_filter(void)
+{
+    pthread_atfork(lock_filter, unlock_filter, unlock_filter);
+}
+
+static int open_filter(void)
+{
+    struct sockaddr_un sun;
+    char *name;
+    int fd;
+
+    if ((get_socket_path(&sun) == 0) &&
+        (strlen(sun.sun_path) + sizeof(NSS_TLS_FILTER_NAME) <=
+         sizeof(sun.sun_path))) {
+        name = strrchr(sun.sun_path, '/');
+        strcpy(name + 1, NSS_TLS_FILTER_NAME);
+
+        fd = open(sun.sun_path, O_RDONLY | O_CLOEXEC);
+        if ((fd >= 0) || (errno != ENOENT))
+            return fd;
+    }
+
+    return open(NSS_TLS_SOCKET_DIR"/"NSS_TLS_FILTER_NAME, O_RDONLY | O_CLOEXEC);
+}
+
+/*
+ * we check once a second whether nss-tlsd has deleted the filter; a filter
+ * that was replaced stays mapped, because other threads may still use it
+ */
+static const struct nss_tls_filter *get_filter(void)
+{
+    const struct nss_tls_filter *ret;
+    struct stat stbuf;
+    void *p;
+    int64_t now;
+
+    pthread_once(&filter_once, init_filter);
+
+    now = get_time();
+
+    lock_filter();
+
+    if (filter_checked && (now - filter_checked < FILTER_CHECK_INTERVAL))
+        goto out;
+
+    filter_checked = now;
+
+    if (filter_fd >= 0) {
+        if ((fstat(filter_fd, &stbuf) == 0) && (stbuf.st_nlink > 0))
+            goto out;
+
+        close(filter_fd);
+        filter_fd = -1;
+        filter = NULL;
+    }
+
+    filter_fd = open_filter();
+    if (filter_fd < 0)
+        goto out;
+
+    if ((fstat(filter_fd, &stbuf) < 0) ||
+        (stbuf.st_size < (off_t)sizeof(*filter)))
+        goto close_fd;
+
+    p = mmap(NULL, sizeof(*filter), PROT_READ, MAP_SHARED, filter_fd, 0);
+    if (p == MAP_FAILED)
+        goto close_fd;
+
+    if (((const struct nss_tls_filter *)p)->magic != NSS_TLS_FILTER_MAGIC) {
+        munmap(p, sizeof(*filter));
+        goto close_fd;
+    }
+
+    filter = p;
+    goto out;
+
+close_fd:
+    close(filter_fd);
+    filter_fd = -1;
+
+out:
+    ret = filter;
+    unlock_filter();
+    return ret;
+}
+
+static int is_in_filter(const struct nss_tls_filter *f,
+                        uint8_t type,
+                        const char *name,
+                        size_t len)
+{
+    uint64_t hash;
+    int i, bit;
+
+    hash = nss_tls_filter_hash(type, name, len);
+    for (i = 0; i < 2; ++i) {
+        bit = nss_tls_filter_bit(hash, i);
+        if (!(f->bloom[bit / 8] & (1 << (bit % 8))))
+            return 0;
+    }
+
+    for (i = 0; (i < f->count) && (i < NSS_TLS_FILTER_MAX); ++i) {
+        if ((f->names[i].type == type) &&
+            (strncmp(f->names[i].name, name, len) == 0) &&
+            (f->names[i].name[len] == '\0'))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* returns 1 if nss-tlsd has not updated its heartbeat for a while */
+static int is_stuck(void)
+{
+    const struct nss_tls_filter *f;
+    int64_t heartbeat;
+
+    f = get_filter();
+    if (!f)
+        return 0;
+
+    heartbeat = __atomic_load_n(&f->heartbeat, __ATOMIC_RELAXED);
+    return (heartbeat > 0) &&
+           (get_time() - heartbeat > NSS_TLS_HEARTBEAT_TIMEOUT * 1000000LL);
+}
+
+/*
+ * returns 1 if nss-tlsd would reject the name, because it has a search domain
+ * suffix or it is the name of a DoH server
+ */
+static int is_rejected(const char *name)
+{
+    char buf[NS_MAXDNAME];
+    const struct nss_tls_filter *f;
+    size_t len, i;
+    uint32_t generation;
+    int ret = 0;
+
+    f = get_filter();
+    if (!f)
+        return 0;
+
+    generation = __atomic_load_n(&f->generation, __ATOMIC_ACQUIRE);
+    if (generation & 1)
+        return 0;
+
+    for (len = 0; name[len] && (len < sizeof(buf) - 1); ++len)
+        buf[len] = tolower((unsigned char)name[len]);
+    if ((len > 0) && (buf[len - 1] == '.'))
+        --len;
+    buf[len] = '\0';
+
+    if (is_in_filter(f, NSS_TLS_FILTER_SERVER, buf, len))
+        ret = 1;
+    else {
+        for (i = 0; i < len; ++i) {
+            if ((buf[i] == '.') &&
+                is_in_filter(f,
+                             NSS_TLS_FILTER_SUFFIX,
+                             &buf[i + 1],
+                             len - i - 1)) {
+                ret = 1;
+                break;
+            }
+        }
+    }
+
+    /* nss-tlsd updated the filter while we were reading it */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&f->generation, __ATOMIC_RELAXED) != generation)
+        return 0;
+
+    return ret;
+}
+
+/*
+ * by default, we wait up to NSS_TLS_TIMEOUT / 2 seconds for each send() or
+ * recv(); NSS_TLS_CLIENT_TIMEOUT overrides this, in milliseconds
+ */
+static void get_timeout(struct timeval *tv)
+{
+    const char *timeout;
+    long ms;
+
+    timeout = secure_getenv("NSS_TLS_CLIENT_TIMEOUT");
+    if (timeout) {
+        ms = strtol(timeout, NULL, 10);
+        if (ms > 0) {
+            tv->tv_sec = ms / 1000;
+            tv->tv_usec = (ms % 1000) * 1000;
+            return;
+        }
+    }
+
+    tv->tv_sec = NSS_TLS_TIMEOUT / 2;
+    tv->tv_usec = 0;
+}
+
+static uint8_t get_prio(void)
+{
+    const char *prio;
+
+    prio = secure_getenv("NSS_TLS_PRIORITY");
+    if (prio) {
+        if (strcmp(prio, "bulk") == 0)
+            return NSS_TLS_PRIO_BULK;
+
+        if (strcmp(prio, "background") == 0)
+            return NSS_TLS_PRIO_BACKGROUND;
+    }
+
+    return NSS_TLS_PRIO_INTERACTIVE;
+}
+
+static void reset_stats(void)
+{
+    struct stats *stats;
+
+    for (stats = all_stats; stats; stats = stats->next) {
+        memset(stats->counts, 0, sizeof(stats->counts));
+        memset(stats->total, 0, sizeof(stats->total));
+        memset(stats->max, 0, sizeof(stats->max));
+    }
+}
+
+static void init_stats(void)
+{
+    /*
+     * libnss_tls is loaded into setuid programs too, and they must not create
+     * or append to a file chosen by the user who runs them
+     */
+    if (getauxval(AT_SECURE))
+        return;
+
+    stats_path = secure_getenv("NSS_TLS_STATS");
+    if (!stats_path || !stats_path[0]) {
+        stats_path = NULL;
+        return;
+    }
+
+    /* a child process reports its own lookups, not its parent's */
+    if (pthread_atfork(NULL, NULL, reset_stats) != 0)
+        stats_path = NULL;
+}
+
+static int stats_enabled(void)
+{
+    pthread_once(&stats_once, init_stats);
+    return stats_path != NULL;
+}
+
+static struct stats *get_stats(void)
+{
+    struct stats *stats = thread_stats;
+
+    if (stats)
+        return stats;
+
+    stats = calloc(1, sizeof(*stats));
+    if (!stats)
+        return NULL;
+
+    stats->next = __atomic_load_n(&all_stats, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&all_stats,
+                                        &stats->next,
+                                        stats,
+                                        1,
+                                        __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED));
+
+    thread_stats = stats;
+    return stats;
+}
+
+static void add_stat(uint64_t *counter, uint64_t n)
+{
+    /* only the thread that owns the counter changes it */
+    __atomic_store_n(counter,
+                     __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+}
+
+static void count_lookup(enum nss_status status,
+                         int error,
+                         enum outcome outcome,
+                         int64_t latency)
+{
+    struct stats *stats;
+    unsigned int bucket = 0;
+
+    if (status == NSS_STATUS_SUCCESS)
+        outcome = OUTCOME_SUCCESS;
+    else if (status == NSS_STATUS_NOTFOUND)
+        outcome = OUTCOME_NOTFOUND;
+    else if (error == ERANGE)
+        outcome = OUTCOME_ERANGE;
+
+    stats = get_stats();
+    if (!stats)
+        return;
+
+    if (latency > 0) {
+        bucket = 64 - __builtin_clzll((unsigned long long)latency);
+        if (bucket >= STATS_BUCKETS)
+            bucket = STATS_BUCKETS - 1;
+    } else
+        latency = 0;
+
+    add_stat(&stats->counts[outcome][bucket], 1);
+    add_stat(&stats->total[outcome], (uint64_t)latency);
+    if ((uint64_t)latency > stats->max[outcome])
+        __atomic_store_n(&stats->max[outcome],
+                         (uint64_t)latency,
+                         __ATOMIC_RELAXED);
+}
+
+static void print_stats(FILE *fp)
+{
+    struct stats *stats;
+    uint64_t counts[OUTCOME_MAX][STATS_BUCKETS] = {{0}};
+    uint64_t total[OUTCOME_MAX] = {0}, max[OUTCOME_MAX] = {0};
+    uint64_t n, lookups = 0;
+    int i, j;
+
+    for (stats = __atomic_load_n(&all_stats, __ATOMIC_ACQUIRE);
+         stats;
+         stats = stats->next) {
+        for (i = 0; i < OUTCOME_MAX; ++i) {
+            for (j = 0; j < STATS_BUCKETS; ++j) {
+                n = __atomic_load_n(&stats->counts[i][j], __ATOMIC_RELAXED);
+                counts[i][j] += n;
+                lookups += n;
+            }
+
+            total[i] += __atomic_load_n(&stats->total[i], __ATOMIC_RELAXED);
+
+            n = __atomic_load_n(&stats->max[i], __ATOMIC_RELAXED);
+            if (n > max[i])
+                max[i] = n;
+        }
+    }
+
+    fprintf(fp,
+            "%s[%ld]: %"PRIu64" lookups\n",
+            program_invocation_short_name,
+            (long)getpid(),
+            lookups);
+
+    for (i = 0; i < OUTCOME_MAX; ++i) {
+        for (n = 0, j = 0; j < STATS_BUCKETS; ++j)
+            n += counts[i][j];
+
+        if (n == 0)
+            continue;
+
+        fprintf(fp,
+                "  %s: %"PRIu64", mean %"PRIu64" us, max %"PRIu64" us\n",
+                outcome_names[i],
+                n,
+                total[i] / n,
+                max[i]);
+
+        for (j = 0; j < STATS_BUCKETS; ++j) {
+            if (counts[i][j] > 0)
+                fprintf(fp,
+                        "    < %"PRIu64" us: %"PRIu64"\n",
+                        (uint64_t)1 << j,
+                        counts[i][j]);
+        }
+    }
+}
+
+/* the report is written at once, so reports of processes don't interleave */
+__attribute__((destructor))
+static void dump_stats(void)
+{
+    FILE *fp;
+    char *report;
+    size_t len, off;
+    ssize_t out;
+    int fd;
+
+    if (!stats_path)
+        return;
+
+    fp = open_memstream(&report, &len);
+    if (!fp)
+        return;
+
+    print_stats(fp);
+
+    if (fclose(fp) != 0)
+        return;
+
+    fd = open(stats_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        for (off = 0; off < len; off += (size_t)out) {
+            out = write(fd, report + off, len - off);
+            if (out <= 0)
+                break;
+        }
+
+        close(fd);
+    }
+
+    free(report);
+}
+
+/* send() and recv() fail with EAGAIN when the timeout expires */
+static enum outcome get_failure(void)
+{
+    if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+        return OUTCOME_TIMEOUT;
+
+    return OUTCOME_OTHER;
+}
+
+static enum nss_status lookup(const char *name,
+                              int af,
+                              struct hostent *ret,
+                              char *buf,
+                              size_t buflen,
+                              int *errnop,
+                              int *h_errnop,
+                              enum outcome *outcome)
 {
     struct sockaddr_un sun = {.sun_family = AF_UNIX};
-    struct timeval tv = {.tv_sec = NSS_TLS_TIMEOUT / 2, .tv_usec = 0};
+    struct timeval tv;
     struct nss_tls_data *data = (struct nss_tls_data *)buf;
-    const char *dir;
     ssize_t out, total;
-    size_t len;
-    int s, i, state;
+    int s, state;
     enum nss_status status = NSS_STATUS_TRYAGAIN;
-    uint8_t count;
 
     if (buflen < sizeof(*data)) {
         *errnop = ERANGE;
@@ -65,26 +754,28 @@ enum nss_status _nss_tls_gethostbyname2_r(const char *name,
     *errnop = ENOENT;
     *h_errnop = NETDB_SUCCESS;
 
-    if (geteuid() == 0)
-        strcpy(sun.sun_path, NSS_TLS_SOCKET_PATH);
-    else {
-        dir = getenv("XDG_RUNTIME_DIR");
-        if (dir) {
-            len = strlen(dir);
-            if (len > sizeof(sun.sun_path) - sizeof("/"NSS_TLS_SOCKET_NAME))
-                return NSS_STATUS_TRYAGAIN;
+    data->req.af = af;
+    strncpy(data->req.name, name, sizeof(data->req.name));
+    data->req.name[sizeof(data->req.name) - 1] = '\0';
+    data->req.prio = get_prio();
 
-            memcpy(sun.sun_path, dir, len);
-            sun.sun_path[len] = '/';
-            ++len;
-            strncpy(sun.sun_path + len,
-                    NSS_TLS_SOCKET_NAME,
-                    sizeof(sun.sun_path) - len);
-            sun.sun_path[sizeof(sun.sun_path) - 1] = '\0';
-        } else
-            strcpy(sun.sun_path, NSS_TLS_SOCKET_PATH);
+    if (is_rejected(data->req.name))
+        return NSS_STATUS_NOTFOUND;
+
+    if (query_cache(data))
+        return fill_hostent(data, af, ret, errnop, h_errnop);
+
+    /* we let the next NSS module try instead of waiting for the timeout */
+    if (is_stuck()) {
+        *errnop = EAGAIN;
+        return NSS_STATUS_UNAVAIL;
     }
 
+    get_timeout(&tv);
+
+    if (get_socket_path(&sun) < 0)
+        return NSS_STATUS_TRYAGAIN;
+
     pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
 
     s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
@@ -104,24 +795,26 @@ enum nss_status _nss_tls_gethostbyname2_r(const char *name,
         goto pop;
 
     if (connect(s, (const struct sockaddr *)&sun, sizeof(sun)) < 0) {
+        *outcome = OUTCOME_CONNECT;
         if (errno != ENOENT)
             goto pop;
 
         strcpy(sun.sun_path, NSS_TLS_SOCKET_PATH);
         if (connect(s, (const struct sockaddr *)&sun, sizeof(sun)) < 0)
             goto pop;
+
+        *outcome = OUTCOME_OTHER;
     }
 
-    data->req.af = af;
-    strncpy(data->req.name, name, sizeof(data->req.name));
-    data->req.name[sizeof(data->req.name) - 1] = '\0';
     for (total = 0; total < sizeof(data->req); total += out) {
         out = send(s,
                    (unsigned char *)&data->req + total,
                    sizeof(data->req) - total,
                    MSG_NOSIGNAL);
-        if (out <= 0)
+        if (out <= 0) {
+            *outcome = get_failure();
             goto pop;
+        }
     }
 
     for (total = 0; total < sizeof(data->res); total += out) {
@@ -129,8 +822,10 @@ enum nss_status _nss_tls_gethostbyname2_r(const char *name,
                    (unsigned char *)&data->res + total,
                    sizeof(data->res) - total,
                    0);
-        if (out < 0)
+        if (out < 0) {
+            *outcome = get_failure();
             goto pop;
+        }
         if (out == 0)
             break;
     }
@@ -143,50 +838,364 @@ enum nss_status _nss_tls_gethostbyname2_r(const char *name,
     if (total != sizeof(data->res))
         goto pop;
 
-    if (data->res.cname[0]) {
-        ret->h_name = data->res.cname;
-        data->aliases[0] = data->req.name;
-        data->aliases[1] = NULL;
-    } else {
-        ret->h_name = data->req.name;
-        data->aliases[0] = NULL;
+    add_to_cache(data);
+    status = fill_hostent(data, af, ret, errnop, h_errnop);
+
+pop:
+    pthread_cleanup_pop(1);
+    return status;
+}
+
+enum nss_status _nss_tls_gethostbyname2_r(const char *name,
+                                          int af,
+                                          struct hostent *ret,
+                                          char *buf,
+                                          size_t buflen,
+                                          int *errnop,
+                                          int *h_errnop)
+{
+    enum nss_status status;
+    enum outcome outcome = OUTCOME_OTHER;
+    int64_t start = 0;
+    int traced = NSS_TLS_PROBE_ENABLED(client_end);
+
+    if (traced || stats_enabled())
+        start = get_time();
+
+    NSS_TLS_PROBE(client_start, name, af);
+
+    status = lookup(name, af, ret, buf, buflen, errnop, h_errnop, &outcome);
+
+    if (traced)
+        NSS_TLS_PROBE(client_end,
+                      name,
+                      af,
+                      status,
+                      *errnop,
+                      get_time() - start);
+
+    if (stats_enabled())
+        count_lookup(status, *errnop, outcome, get_time() - start);
+
+    return status;
+}
+
+/*
+ * each asynchronous lookup uses its own non-blocking connection to nss-tlsd;
+ * all connections and a timer that fires when the oldest lookup times out are
+ * watched by one epoll instance, and lookups are kept in the order they were
+ * submitted, which is also the order of their deadlines
+ */
+struct nss_tls_lookup {
+    struct nss_tls_lookup *prev;
+    struct nss_tls_lookup *next;
+    uint64_t id;
+    int fd;
+    int64_t deadline;
+    size_t off;
+    struct nss_tls_req req;
+    struct nss_tls_res res;
+};
+
+struct nss_tls_async {
+    int epfd;
+    int timer;
+    struct nss_tls_lookup *head;
+    struct nss_tls_lookup *tail;
+};
+
+struct nss_tls_async *nss_tls_async_new(void)
+{
+    struct nss_tls_async *ctx;
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+
+    ctx = calloc(1, sizeof(*ctx));
+    if (!ctx)
+        return NULL;
+
+    ctx->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (ctx->epfd < 0)
+        goto free_ctx;
+
+    ctx->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (ctx->timer < 0)
+        goto close_epfd;
+
+    if (epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, ctx->timer, &ev) < 0)
+        goto close_timer;
+
+    return ctx;
+
+close_timer:
+    close(ctx->timer);
+close_epfd:
+    close(ctx->epfd);
+free_ctx:
+    free(ctx);
+    return NULL;
+}
+
+static void remove_lookup(struct nss_tls_async *ctx,
+                          struct nss_tls_lookup *lookup)
+{
+    if (lookup->prev)
+        lookup->prev->next = lookup->next;
+    else
+        ctx->head = lookup->next;
+
+    if (lookup->next)
+        lookup->next->prev = lookup->prev;
+    else
+        ctx->tail = lookup->prev;
+
+    if (lookup->fd >= 0)
+        close(lookup->fd);
+    free(lookup);
+}
+
+void nss_tls_async_free(struct nss_tls_async *ctx)
+{
+    while (ctx->head)
+        remove_lookup(ctx, ctx->head);
+
+    close(ctx->timer);
+    close(ctx->epfd);
+    free(ctx);
+}
+
+int nss_tls_async_fd(const struct nss_tls_async *ctx)
+{
+    return ctx->epfd;
+}
+
+static void arm_timer(struct nss_tls_async *ctx)
+{
+    struct itimerspec its = {{0, 0}, {0, 0}};
+
+    if (ctx->head) {
+        its.it_value.tv_sec = ctx->head->deadline / 1000000;
+        its.it_value.tv_nsec = (ctx->head->deadline % 1000000) * 1000;
     }
-    ret->h_aliases = data->aliases;
-    ret->h_addrtype = af;
-    data->addrs[0] = NULL;
-    ret->h_addr_list = data->addrs;
 
-    count = data->res.count;
-    if (count == 0) {
-        *h_errnop = HOST_NOT_FOUND;
-        status = NSS_STATUS_NOTFOUND;
-        goto pop;
+    timerfd_settime(ctx->timer, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+int nss_tls_async_submit(struct nss_tls_async *ctx,
+                         const char *name,
+                         int af,
+                         uint64_t id)
+{
+    struct sockaddr_un sun = {.sun_family = AF_UNIX};
+    struct epoll_event ev = {.events = EPOLLIN};
+    struct nss_tls_lookup *lookup;
+    ssize_t out;
+    int err;
+
+    if (get_socket_path(&sun) < 0) {
+        errno = ENAMETOOLONG;
+        return -1;
     }
-    if (count > NSS_TLS_ADDRS_MAX)
-        count = NSS_TLS_ADDRS_MAX;
 
-    switch (af) {
-    case AF_INET:
-        ret->h_length = sizeof(struct in_addr);
-        break;
+    lookup = malloc(sizeof(*lookup));
+    if (!lookup)
+        return -1;
 
-    case AF_INET6:
-        ret->h_length = sizeof(struct in6_addr);
-        break;
+    lookup->id = id;
+    lookup->req.af = af;
 
-    default:
-        status = NSS_STATUS_NOTFOUND;
-        goto pop;
+    /*
+     * like lookup(), we don't bother nss-tlsd with names it would reject: the
+     * lookup expires immediately and nss_tls_async_reap() completes it with
+     * ENOENT
+     */
+    if (is_rejected(name)) {
+        lookup->fd = -1;
+        lookup->deadline = get_time();
+        lookup->prev = NULL;
+        lookup->next = ctx->head;
+        if (ctx->head)
+            ctx->head->prev = lookup;
+        else
+            ctx->tail = lookup;
+        ctx->head = lookup;
+        arm_timer(ctx);
+        return 0;
     }
 
-    for (i = 0; i < count; ++i)
-        data->addrs[i] = (char *)&data->res.addrs[i];
-    data->addrs[i] = NULL;
+    if (is_stuck()) {
+        errno = EAGAIN;
+        goto free_lookup;
+    }
 
-    *errnop = 0;
-    status = NSS_STATUS_SUCCESS;
+    lookup->fd = socket(AF_UNIX,
+                        SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        0);
+    if (lookup->fd < 0)
+        goto free_lookup;
 
-pop:
-    pthread_cleanup_pop(1);
-    return status;
+    /*
+     * connecting to a Unix socket does not wait for nss-tlsd to accept the
+     * connection, but fails with EAGAIN if its backlog is full
+     */
+    if (connect(lookup->fd, (const struct sockaddr *)&sun, sizeof(sun)) < 0) {
+        if (errno != ENOENT)
+            goto close_fd;
+
+        strcpy(sun.sun_path, NSS_TLS_SOCKET_PATH);
+        if (connect(lookup->fd,
+                    (const struct sockaddr *)&sun,
+                    sizeof(sun)) < 0)
+            goto close_fd;
+    }
+
+    strncpy(lookup->req.name, name, sizeof(lookup->req.name));
+    lookup->req.name[sizeof(lookup->req.name) - 1] = '\0';
+    lookup->req.prio = get_prio();
+
+    /* the request is much smaller than the socket buffer */
+    out = send(lookup->fd, &lookup->req, sizeof(lookup->req), MSG_NOSIGNAL);
+    if (out != sizeof(lookup->req)) {
+        if (out >= 0)
+            errno = EAGAIN;
+        goto close_fd;
+    }
+
+    ev.data.ptr = lookup;
+    if (epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, lookup->fd, &ev) < 0)
+        goto close_fd;
+
+    lookup->off = 0;
+    lookup->deadline = get_time() + NSS_TLS_TIMEOUT * 1000000LL;
+    lookup->next = NULL;
+    lookup->prev = ctx->tail;
+    if (ctx->tail)
+        ctx->tail->next = lookup;
+    else {
+        ctx->head = lookup;
+        arm_timer(ctx);
+    }
+    ctx->tail = lookup;
+
+    return 0;
+
+close_fd:
+    err = errno;
+    close(lookup->fd);
+    errno = err;
+free_lookup:
+    free(lookup);
+    return -1;
+}
+
+static void complete_lookup(struct nss_tls_async *ctx,
+                            struct nss_tls_lookup *lookup,
+                            struct nss_tls_async_result *result,
+                            int error)
+{
+    result->id = lookup->id;
+    result->af = lookup->req.af;
+    result->error = error;
+    result->count = 0;
+    result->cname[0] = '\0';
+
+    if (error == 0) {
+        result->count = lookup->res.count;
+        if (result->count > NSS_TLS_ADDRS_MAX)
+            result->count = NSS_TLS_ADDRS_MAX;
+        memcpy(result->addrs,
+               lookup->res.addrs,
+               result->count * sizeof(result->addrs[0]));
+        memcpy(result->cname, lookup->res.cname, sizeof(result->cname));
+        result->cname[sizeof(result->cname) - 1] = '\0';
+
+        if (result->count == 0)
+            result->error = ENOENT;
+    }
+
+    remove_lookup(ctx, lookup);
+}
+
+/* returns 1 if the lookup is complete */
+static int read_response(struct nss_tls_lookup *lookup, int *error)
+{
+    ssize_t in;
+
+    do {
+        in = recv(lookup->fd,
+                  (unsigned char *)&lookup->res + lookup->off,
+                  sizeof(lookup->res) - lookup->off,
+                  MSG_DONTWAIT);
+        if (in > 0)
+            lookup->off += in;
+    } while ((in > 0) && (lookup->off < sizeof(lookup->res)));
+
+    if (lookup->off == sizeof(lookup->res)) {
+        *error = 0;
+        return 1;
+    }
+
+    if (in < 0) {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+            return 0;
+
+        *error = EIO;
+        return 1;
+    }
+
+    /* nss-tlsd closes the connection without a response if it rejects a name */
+    *error = (lookup->off == 0) ? ENOENT : EIO;
+    return 1;
+}
+
+int nss_tls_async_reap(struct nss_tls_async *ctx,
+                       struct nss_tls_async_result *results,
+                       int max)
+{
+    struct epoll_event evs[64];
+    struct nss_tls_lookup *lookup;
+    uint64_t expirations;
+    int64_t now;
+    int nevs, i, n = 0, error;
+
+    if (max <= 0)
+        return 0;
+
+    nevs = epoll_wait(ctx->epfd,
+                      evs,
+                      (max < 64) ? max : 64,
+                      0);
+    if (nevs < 0)
+        return (errno == EINTR) ? 0 : -1;
+
+    for (i = 0; i < nevs; ++i) {
+        lookup = evs[i].data.ptr;
+        if (!lookup) {
+            /*
+             * EAGAIN means another thread consumed the expiration; other
+             * errors happen again on the next call, so we return the
+             * results we already have first
+             */
+            if ((read(ctx->timer,
+                      &expirations,
+                      sizeof(expirations)) < 0) &&
+                (errno != EAGAIN) &&
+                (n == 0))
+                return -1;
+            continue;
+        }
+
+        if (read_response(lookup, &error))
+            complete_lookup(ctx, lookup, &results[n++], error);
+    }
+
+    now = get_time();
+    /* rejected names expire immediately */
+    while (ctx->head && (ctx->head->deadline <= now) && (n < max))
+        complete_lookup(ctx,
+                        ctx->head,
+                        &results[n++],
+                        (ctx->head->fd < 0) ? ENOENT : ETIMEDOUT);
+
+    arm_timer(ctx);
+    return n;
 }
@@ -18,17 +18,61 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
  */
 
+#ifndef _NSS_TLS_H_INCLUDED
+#define _NSS_TLS_H_INCLUDED
+
+#include <stddef.h>
 #include <inttypes.h>
 #include <netinet/in.h>
 #include <arpa/nameser.h>
+#ifdef NSS_TLS_USDT
+#   include <sys/sdt.h>
+#endif
 
 #define NSS_TLS_ADDRS_MAX 16
 
+/*
+ * USDT probes, for bpftrace and perf: a probe that is not traced costs a nop,
+ * but its arguments are still computed, so they should be cheap
+ *
+ * a file that defines _SDT_HAS_SEMAPHORES before including this header must
+ * define a semaphore for each of its probes, using NSS_TLS_PROBE_SEMAPHORE();
+ * tracers increment it while the probe is traced, so NSS_TLS_PROBE_ENABLED()
+ * tells whether costly arguments are needed
+ */
+#ifdef NSS_TLS_USDT
+#   define NSS_TLS_PROBE(name, ...) STAP_PROBEV(nss_tls, name, ##__VA_ARGS__)
+#   define NSS_TLS_PROBE_SEMAPHORE(name) \
+        unsigned short nss_tls_##name##_semaphore \
+        __attribute__((unused, section(".probes"), visibility("hidden")))
+#   define NSS_TLS_PROBE_ENABLED(name) \
+        __builtin_expect(nss_tls_##name##_semaphore != 0, 0)
+#else
+#   define NSS_TLS_PROBE(name, ...) do {} while (0)
+#   define NSS_TLS_PROBE_ENABLED(name) 0
+#endif
+
+/* lookups of a lower priority class use a smaller share of the connections */
+enum nss_tls_prio {
+    NSS_TLS_PRIO_INTERACTIVE,
+    NSS_TLS_PRIO_BULK,
+    NSS_TLS_PRIO_BACKGROUND,
+    NSS_TLS_PRIO_MAX
+};
+
 struct nss_tls_req {
     int af;
     char name[NS_MAXDNAME];
+    uint8_t prio;
 } __attribute__((packed));
 
+/*
+ * libnss_tls sends each request with one send(), so nss-tlsd receives it
+ * whole; a request of this size comes from a libnss_tls older than priority
+ * classes, still loaded by a running process, and is handled as interactive
+ */
+#define NSS_TLS_REQ_V1_SIZE offsetof(struct nss_tls_req, prio)
+
 struct nss_tls_res {
     uint8_t count;
     int64_t expiry;
@@ -39,9 +83,96 @@ struct nss_tls_res {
     } addrs[NSS_TLS_ADDRS_MAX];
 } __attribute__((packed));
 
+/*
+ * nss-tlsd publishes the names it always rejects in a shared file next to its
+ * socket, so libnss_tls can reject them without a round trip: names with a
+ * search domain suffix and DoH server names, indexed by a Bloom filter; the
+ * generation is odd while nss-tlsd updates the file
+ *
+ * nss-tlsd also updates the heartbeat (the CLOCK_MONOTONIC time, in
+ * microseconds) every NSS_TLS_HEARTBEAT_INTERVAL seconds, so libnss_tls
+ * can detect when nss-tlsd is stuck
+ */
+#define NSS_TLS_FILTER_MAGIC 0x6e746c74
+#define NSS_TLS_FILTER_BITS 8192
+#define NSS_TLS_FILTER_MAX 32
+#define NSS_TLS_HEARTBEAT_INTERVAL 1
+#define NSS_TLS_HEARTBEAT_TIMEOUT 3
+
+enum nss_tls_filter_type {
+    NSS_TLS_FILTER_SUFFIX,
+    NSS_TLS_FILTER_SERVER
+};
+
+struct nss_tls_filter {
+    uint32_t magic;
+    uint32_t generation;
+    int64_t heartbeat;
+    uint8_t bloom[NSS_TLS_FILTER_BITS / 8];
+    uint8_t count;
+    struct {
+        uint8_t type;
+        char name[NS_MAXDNAME];
+    } names[NSS_TLS_FILTER_MAX];
+};
+
+static inline uint64_t nss_tls_filter_hash(uint8_t type,
+                                           const char *name,
+                                           size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL ^ type;
+    size_t i;
+
+    for (i = 0; i < len; ++i)
+        hash = (hash ^ (unsigned char)name[i]) * 1099511628211ULL;
+
+    return hash;
+}
+
+/* each name sets two bits, from the two halves of its hash */
+static inline int nss_tls_filter_bit(uint64_t hash, int i)
+{
+    return (int)((i ? (hash >> 32) : (hash & 0xffffffff)) %
+                 NSS_TLS_FILTER_BITS);
+}
+
+/*
+ * the query log written by nss-tlsd --query-log: a header, then a record for
+ * each lookup, followed by the name and the name of the DoH server it was
+ * sent to, if any; times are in microseconds
+ */
+#define NSS_TLS_LOG_MAGIC 0x6e746c71
+#define NSS_TLS_LOG_VERSION 2
+#define NSS_TLS_LOG_NO_TTL UINT32_MAX
+
+enum nss_tls_log_result {
+    NSS_TLS_LOG_CACHED,
+    NSS_TLS_LOG_RESOLVED,
+    NSS_TLS_LOG_FAILED
+};
+
+struct nss_tls_log_header {
+    uint32_t magic;
+    uint32_t version;
+} __attribute__((packed));
+
+struct nss_tls_log_entry {
+    int64_t time; /* since the epoch */
+    uint32_t latency;
+    uint32_t client; /* the process ID, or 0 for DNS clients */
+    uint32_t ttl; /* in seconds, before the minimum TTL is applied */
+    uint8_t af;
+    uint8_t result;
+    uint8_t count;
+    uint8_t name_len;
+    uint8_t server_len;
+} __attribute__((packed));
+
 struct nss_tls_data {
     char *aliases[2];
     char *addrs[NSS_TLS_ADDRS_MAX + 1];
     struct nss_tls_req req;
     struct nss_tls_res res;
 };
+
+#endif
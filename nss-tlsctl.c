@@ -0,0 +1,175 @@
+/*
+ * This file is part of nss-tls.
+ *
+ * Copyright (C) 2019  Dima Krasner
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "nss-tls.h"
+
+#define ERROR_PREFIX "error: "
+
+/* like libnss_tls, root talks to the system nss-tlsd instance */
+static int get_socket_path(struct sockaddr_un *sun, const char *path)
+{
+    const char *dir;
+
+    if (!path) {
+        if (geteuid() == 0)
+            path = NSS_TLS_ADMIN_SOCKET_PATH;
+        else {
+            dir = getenv("XDG_RUNTIME_DIR");
+            if (!dir)
+                return -1;
+
+            if (snprintf(sun->sun_path,
+                         sizeof(sun->sun_path),
+                         "%s/"NSS_TLS_ADMIN_SOCKET_NAME,
+                         dir) >= sizeof(sun->sun_path))
+                return -1;
+
+            return 0;
+        }
+    }
+
+    if (strlen(path) >= sizeof(sun->sun_path))
+        return -1;
+
+    strcpy(sun->sun_path, path);
+    return 0;
+}
+
+static int send_all(int s, const char *buf, size_t len)
+{
+    ssize_t out;
+    size_t total;
+
+    for (total = 0; total < len; total += out) {
+        out = send(s, buf + total, len - total, MSG_NOSIGNAL);
+        if (out <= 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_un sun = {.sun_family = AF_UNIX};
+    char buf[4096], *line, *p;
+    const char *path = NULL;
+    ssize_t len;
+    size_t size = 0, total = 0;
+    int s, opt, i, failed = 0, ret = EXIT_FAILURE;
+
+    while ((opt = getopt(argc, argv, "+s:")) != -1) {
+        switch (opt) {
+        case 's':
+            path = optarg;
+            break;
+
+        default:
+            optind = argc;
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr,
+                "Usage: nss-tlsctl [-s SOCKET] COMMAND [ARG...]\n"
+                "Control a running nss-tlsd instance.\n"
+                "\n"
+                "Commands:\n"
+                "  flush [NAME]          Flush the cache, or one name\n"
+                "  flush-suffix SUFFIX   Flush SUFFIX and all names under it\n"
+                "  dump                  Print the cached names\n"
+                "  stats                 Print statistics\n"
+                "  preload NAME...       Resolve names into the cache\n"
+                "  cache-size SIZE       Change the cache size\n"
+                "  log-level LEVEL       Change the log level (debug, info, "
+                "message or warning)\n");
+        return EXIT_FAILURE;
+    }
+
+    /* the command is sent as one line of space-separated words */
+    for (i = optind; i < argc; ++i) {
+        if (strpbrk(argv[i], " \t\n")) {
+            fprintf(stderr, "Bad argument: %s\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+
+        size += strlen(argv[i]) + 1;
+    }
+
+    line = malloc(size);
+    if (!line)
+        return EXIT_FAILURE;
+
+    for (i = optind, p = line; i < argc; ++i) {
+        len = strlen(argv[i]);
+        memcpy(p, argv[i], len);
+        p += len;
+        *p++ = (i == argc - 1) ? '\n' : ' ';
+    }
+
+    if (get_socket_path(&sun, path) < 0) {
+        fprintf(stderr, "Bad socket path\n");
+        goto free_line;
+    }
+
+    s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s < 0)
+        goto free_line;
+
+    if (connect(s, (const struct sockaddr *)&sun, sizeof(sun)) < 0) {
+        perror(sun.sun_path);
+        goto close_socket;
+    }
+
+    if (send_all(s, line, size) < 0)
+        goto close_socket;
+
+    while ((len = recv(s, buf, sizeof(buf), 0)) > 0) {
+        /* errors are reported at the beginning of the reply */
+        if ((total < sizeof(ERROR_PREFIX) - 1) &&
+            (strncmp(buf,
+                     ERROR_PREFIX + total,
+                     MIN(len, sizeof(ERROR_PREFIX) - 1 - total)) == 0))
+            failed = 1;
+
+        if (fwrite(buf, 1, (size_t)len, stdout) != (size_t)len)
+            goto close_socket;
+
+        total += (size_t)len;
+    }
+
+    if ((len == 0) && (total > 0) && !failed)
+        ret = EXIT_SUCCESS;
+
+close_socket:
+    close(s);
+
+free_line:
+    free(line);
+    return ret;
+}
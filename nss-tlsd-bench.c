@@ -0,0 +1,463 @@
+/*
+ * This file is part of nss-tls.
+ *
+ * Copyright (C) 2019  Dima Krasner
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+#include <glib.h>
+
+#include "nss-tls.h"
+#include "nss-tlsd-cache.h"
+#include "nss-tlsd-query.h"
+
+#define RUN_NSECS 10000000
+#define REPETITIONS 5
+#define NAMES 4096
+#define CACHED_NAMES 512
+#define RESOLVERS 3
+#define QUERY_SIZE 512
+
+/*
+ * nss-tlsd-bench measures the functions nss-tlsd calls for every lookup: each
+ * benchmark is warmed up by doubling the number of iterations until a run takes
+ * RUN_NSECS, then it's repeated REPETITIONS times with that many iterations,
+ * and we report the median time and the number of allocations per iteration
+ */
+struct bench {
+    const gchar *name;
+    void (*setup) (void);
+    void (*run) (const guint64 n);
+    void (*teardown) (void);
+};
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static guint64 allocs = 0;
+
+static struct {
+    gchar str[NS_MAXDNAME];
+    guint hash;
+} names[NAMES];
+
+static unsigned char query[QUERY_SIZE];
+static int query_len;
+static unsigned char response[QUERY_SIZE];
+static gsize response_len;
+
+static volatile guint64 sink;
+
+/* GLib allocates through malloc(), so we count allocations here */
+void *
+malloc (size_t size)
+{
+    ++allocs;
+    return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+    ++allocs;
+    return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+    ++allocs;
+    return __libc_realloc (ptr, size);
+}
+
+static
+gint64
+get_nsecs (void)
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (gint64)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static
+void
+setup_names (void)
+{
+    guint i;
+
+    for (i = 0; i < NAMES; ++i) {
+        g_snprintf (names[i].str,
+                    sizeof (names[i].str),
+                    "host%u.example.com",
+                    i);
+        nss_tls_normalize_name (names[i].str, &names[i].hash);
+    }
+}
+
+static
+void
+run_normalize_name (const guint64 n)
+{
+    gchar name[NS_MAXDNAME];
+    guint64 i;
+    guint hash;
+
+    for (i = 0; i < n; ++i) {
+        strcpy (name, "WWW.Example.COM.");
+        nss_tls_normalize_name (name, &hash);
+        sink += hash;
+    }
+}
+
+static
+void
+run_make_query (const guint64 n)
+{
+    unsigned char buf[QUERY_SIZE];
+    guint64 i;
+    int type;
+
+    for (i = 0; i < n; ++i) {
+        sink += nss_tls_make_query (names[i % NAMES].str,
+                                    AF_INET,
+                                    buf,
+                                    sizeof (buf),
+                                    &type);
+    }
+}
+
+static
+void
+setup_query (void)
+{
+    int type;
+
+    query_len = nss_tls_make_query ("www.example.com",
+                                    AF_INET,
+                                    query,
+                                    sizeof (query),
+                                    &type);
+}
+
+static
+void
+run_encode_query (const guint64 n)
+{
+    gchar *dns;
+    guint64 i;
+
+    for (i = 0; i < n; ++i) {
+        dns = nss_tls_encode_query (query, (gsize)query_len);
+        sink += dns[0];
+        g_free (dns);
+    }
+}
+
+static
+gsize
+put_rr (unsigned char   *p,
+        const guint16   type,
+        const guint32   ttl,
+        const void      *rdata,
+        const guint16   rdlen)
+{
+    /* a pointer to the question name */
+    p[0] = 0xc0;
+    p[1] = HFIXEDSZ;
+    ns_put16 (type, p + 2);
+    ns_put16 (ns_c_in, p + 4);
+    ns_put32 (ttl, p + 6);
+    ns_put16 (rdlen, p + 10);
+    memcpy (p + 12, rdata, rdlen);
+
+    return 12 + rdlen;
+}
+
+/* a typical response: a CNAME record followed by two A records */
+static
+void
+setup_response (void)
+{
+    static const unsigned char cname[] = "\3cdn\7example\3net";
+    static const unsigned char addrs[][4] = {
+        {192, 0, 2, 1},
+        {192, 0, 2, 2}
+    };
+    HEADER *hdr;
+
+    setup_query ();
+
+    memcpy (response, query, query_len);
+    response_len = (gsize)query_len;
+
+    hdr = (HEADER *)response;
+    hdr->qr = 1;
+    hdr->ra = 1;
+    hdr->ancount = htons (3);
+
+    response_len += put_rr (response + response_len,
+                            ns_t_cname,
+                            300,
+                            cname,
+                            sizeof (cname));
+    response_len += put_rr (response + response_len,
+                            ns_t_a,
+                            60,
+                            addrs[0],
+                            sizeof (addrs[0]));
+    response_len += put_rr (response + response_len,
+                            ns_t_a,
+                            120,
+                            addrs[1],
+                            sizeof (addrs[1]));
+
+    nss_tls_cache_init (NSS_TLS_CACHE_SIZE,
+                        NSS_TLS_CACHE_TINYLFU,
+                        NSS_TLS_CACHE_MIN_TTL,
+                        NSS_TLS_CACHE_FALLBACK_TTL);
+}
+
+static
+void
+run_parse_response (const guint64 n)
+{
+    struct nss_tls_res res;
+    gint64 ttl, now = get_nsecs () / 1000;
+    guint64 i;
+
+    for (i = 0; i < n; ++i) {
+        res.count = 0;
+        res.expiry = -1;
+        res.cname[0] = '\0';
+        ttl = -1;
+
+        nss_tls_parse_response ("www.example.com",
+                                response,
+                                response_len,
+                                AF_INET,
+                                FALSE,
+                                &res,
+                                &ttl,
+                                now);
+        sink += res.count;
+    }
+}
+
+static
+void
+setup_cache (void)
+{
+    struct nss_tls_res res = {.count = 1, .expiry = -1, .cname = ""};
+    gint64 now = get_nsecs () / 1000;
+    guint i;
+
+    setup_names ();
+
+    nss_tls_cache_init (NSS_TLS_CACHE_SIZE,
+                        NSS_TLS_CACHE_TINYLFU,
+                        NSS_TLS_CACHE_MIN_TTL,
+                        NSS_TLS_CACHE_FALLBACK_TTL);
+
+    for (i = 0; i < CACHED_NAMES; ++i) {
+        res.expiry = nss_tls_cache_get_expiry (3600, now);
+        nss_tls_cache_add (AF_INET,
+                           names[i].str,
+                           names[i].hash,
+                           &res,
+                           3600,
+                           FALSE,
+                           now);
+    }
+}
+
+/* the same calls as get_cached_response() in nss-tlsd; half are hits */
+static
+void
+run_cache_query (const guint64 n)
+{
+    const struct nss_tls_cache_entry *entry;
+    guint64 i;
+    guint j;
+
+    for (i = 0; i < n; ++i) {
+        j = i % (CACHED_NAMES * 2);
+
+        nss_tls_cache_count_lookup (names[j].hash);
+        entry = nss_tls_cache_query (AF_INET,
+                                     nss_tls_find_name (names[j].str,
+                                                        names[j].hash));
+        sink += entry ? entry->count : 0;
+    }
+}
+
+/* more names than the cache can hold, so most additions evict an entry */
+static
+void
+run_cache_add (const guint64 n)
+{
+    struct nss_tls_res res = {.count = 1, .cname = ""};
+    gint64 now = get_nsecs () / 1000;
+    guint64 i;
+    guint j;
+
+    for (i = 0; i < n; ++i) {
+        j = i % NAMES;
+
+        res.expiry = nss_tls_cache_get_expiry (3600, now);
+        nss_tls_cache_count_lookup (names[j].hash);
+        nss_tls_cache_add (AF_INET,
+                           names[j].str,
+                           names[j].hash,
+                           &res,
+                           3600,
+                           FALSE,
+                           now);
+    }
+
+    sink += nss_tls_cache_get_size (AF_INET);
+}
+
+static
+void
+run_is_suffixed (const guint64 n)
+{
+    guint64 i;
+
+    for (i = 0; i < n; ++i) {
+        sink += nss_tls_is_suffixed (names[i % NAMES].str);
+    }
+}
+
+static
+void
+run_hash_resolver (const guint64 n)
+{
+    guint64 i;
+
+    for (i = 0; i < n; ++i) {
+        sink += nss_tls_hash_resolver (names[i % NAMES].str, RESOLVERS);
+    }
+}
+
+static const struct bench benches[] = {
+    {"normalize_name", NULL, run_normalize_name, NULL},
+    {"make_query", setup_names, run_make_query, NULL},
+    {"encode_query", setup_query, run_encode_query, NULL},
+    {"parse_response", setup_response, run_parse_response, nss_tls_cache_free},
+    {"cache_query", setup_cache, run_cache_query, nss_tls_cache_free},
+    {"cache_add", setup_cache, run_cache_add, nss_tls_cache_free},
+    {"is_suffixed", setup_names, run_is_suffixed, NULL},
+    {"hash_resolver", setup_names, run_hash_resolver, NULL},
+};
+
+static
+gint
+compare_doubles (gconstpointer a, gconstpointer b)
+{
+    gdouble x = *(const gdouble *)a, y = *(const gdouble *)b;
+
+    return (x > y) - (x < y);
+}
+
+static
+void
+run_bench (const struct bench *bench)
+{
+    gdouble nsecs[REPETITIONS], allocs_per_op = 0;
+    gint64 start, elapsed;
+    guint64 n, before;
+    guint i;
+
+    if (bench->setup) {
+        bench->setup ();
+    }
+
+    for (n = 1; ; n *= 2) {
+        start = get_nsecs ();
+        bench->run (n);
+        elapsed = get_nsecs () - start;
+
+        if (elapsed >= RUN_NSECS) {
+            break;
+        }
+    }
+
+    for (i = 0; i < REPETITIONS; ++i) {
+        before = allocs;
+        start = get_nsecs ();
+        bench->run (n);
+        elapsed = get_nsecs () - start;
+
+        nsecs[i] = (gdouble)elapsed / n;
+        allocs_per_op = (gdouble)(allocs - before) / n;
+    }
+
+    if (bench->teardown) {
+        bench->teardown ();
+    }
+
+    qsort (nsecs, REPETITIONS, sizeof (nsecs[0]), compare_doubles);
+
+    g_print ("%-16s %10.1f ns/op %8.2f allocs/op "
+             "(min %.1f, max %.1f, %"G_GUINT64_FORMAT" iterations)\n",
+             bench->name,
+             nsecs[REPETITIONS / 2],
+             allocs_per_op,
+             nsecs[0],
+             nsecs[REPETITIONS - 1],
+             n);
+}
+
+int
+main (int    argc,
+      char   **argv)
+{
+    guint i;
+    int j, ret = EXIT_SUCCESS;
+
+    if (argc == 1) {
+        for (i = 0; i < G_N_ELEMENTS (benches); ++i) {
+            run_bench (&benches[i]);
+        }
+
+        return EXIT_SUCCESS;
+    }
+
+    for (j = 1; j < argc; ++j) {
+        for (i = 0; i < G_N_ELEMENTS (benches); ++i) {
+            if (strcmp (argv[j], benches[i].name) == 0) {
+                run_bench (&benches[i]);
+                break;
+            }
+        }
+
+        if (i == G_N_ELEMENTS (benches)) {
+            g_printerr ("Unknown benchmark: %s\n", argv[j]);
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    return ret;
+}
@@ -0,0 +1,713 @@
+/*
+ * This file is part of nss-tls.
+ *
+ * Copyright (C) 2018, 2019  Dima Krasner
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+
+#include <glib.h>
+
+#include "nss-tls.h"
+#include "nss-tlsd-cache.h"
+
+#define CACHE_WINDOW_SHARE 32
+#define SKETCH_DEPTH 4
+#define SKETCH_MAX 15
+
+static GHashTable *names = NULL;
+static gsize name_bytes = 0;
+
+static struct {
+    GHashTable *entries;
+    GQueue window;
+    GQueue main;
+} caches[2] = {
+    {NULL, G_QUEUE_INIT, G_QUEUE_INIT},
+    {NULL, G_QUEUE_INIT, G_QUEUE_INIT}
+};
+
+static enum nss_tls_cache_policy cache_policy = NSS_TLS_CACHE_TINYLFU;
+static guint window_size = 0;
+static gint64 min_ttl = 0;
+static gint64 fallback_ttl = 0;
+
+/*
+ * the maximum number of entries in each cache, which shrinks under memory
+ * pressure
+ */
+static guint cache_budget = 0;
+
+/*
+ * a count-min sketch of lookup frequencies, shared by both caches; counters
+ * are halved every 10 lookups per cache entry, so old popularity fades away
+ */
+static struct {
+    guint8 *counters[SKETCH_DEPTH];
+    guint width;
+    guint age;
+    guint lookups;
+} sketch;
+
+/*
+ * names are lowercased and hashed 8 bytes at a time; a word of ASCII
+ * characters cannot overflow from one byte to the next when we add 0x3f (to
+ * set the high bit of each byte >= 'A') or 0x25 (for bytes > 'Z')
+ */
+#define SWAR_ONES G_GUINT64_CONSTANT (0x0101010101010101)
+#define SWAR_HIGH (SWAR_ONES * 0x80)
+
+static
+guint64
+mix_name_word (guint64 hash, const guint64 word)
+{
+    hash ^= word;
+    hash *= G_GUINT64_CONSTANT (0x100000001b3);
+    return hash ^ (hash >> 29);
+}
+
+/*
+ * we lowercase the name, strip the trailing dot and reject names that are not
+ * ASCII (IDNs must be in their ACE form), contain control characters or have
+ * empty or too long labels; returns FALSE if the name is invalid
+ */
+gboolean
+nss_tls_normalize_name (gchar *name, guint *hash)
+{
+    guint64 word, upper, h = G_GUINT64_CONSTANT (0xcbf29ce484222325);
+    const gchar *label, *dot;
+    gsize len, i, n;
+
+    len = strnlen (name, NS_MAXDNAME);
+    if ((len > 0) && (name[len - 1] == '.')) {
+        name[--len] = '\0';
+    }
+
+    if ((len == 0) || (len > NS_MAXDNAME - 1)) {
+        return FALSE;
+    }
+
+    for (label = name; ; label = dot + 1) {
+        dot = memchr (label, '.', len - (label - name));
+        n = dot ? (gsize)(dot - label) : len - (label - name);
+        if ((n == 0) || (n > NS_MAXLABEL)) {
+            return FALSE;
+        }
+
+        if (!dot) {
+            break;
+        }
+    }
+
+    for (i = 0; i < len; i += sizeof (word)) {
+        n = MIN (len - i, sizeof (word));
+
+        /* we pad the last word with '!', which is neither upper nor control */
+        word = SWAR_ONES * '!';
+        memcpy (&word, name + i, n);
+
+        /* reject non-ASCII and control characters */
+        if ((word & SWAR_HIGH) ||
+            ((word - SWAR_ONES * 0x21) & ~word & SWAR_HIGH)) {
+            return FALSE;
+        }
+
+        upper = (word + SWAR_ONES * 0x3f) & ~(word + SWAR_ONES * 0x25) &
+                SWAR_HIGH;
+        word |= upper >> 2;
+
+        memcpy (name + i, &word, n);
+        h = mix_name_word (h, word);
+    }
+
+    *hash = (guint)(h ^ (h >> 32));
+    return TRUE;
+}
+
+static
+guint
+hash_name (gconstpointer key)
+{
+    return ((const struct nss_tls_name *)key)->hash;
+}
+
+static
+gboolean
+equal_names (gconstpointer a, gconstpointer b)
+{
+    const struct nss_tls_name *na = a, *nb = b;
+
+    return (na->hash == nb->hash) &&
+           (na->len == nb->len) &&
+           (memcmp (na->str, nb->str, na->len) == 0);
+}
+
+/* returns the interned form of a normalized name, if there is one */
+struct nss_tls_name *
+nss_tls_find_name (const gchar *name, const guint hash)
+{
+    struct nss_tls_name key = {.hash = hash, .str = name};
+
+    if (!names) {
+        return NULL;
+    }
+
+    key.len = strlen (name);
+    return g_hash_table_lookup (names, &key);
+}
+
+static
+struct nss_tls_name *
+intern_name (const gchar *name, const guint hash)
+{
+    struct nss_tls_name *atom;
+    gsize len;
+
+    atom = nss_tls_find_name (name, hash);
+    if (atom) {
+        ++atom->refs;
+        return atom;
+    }
+
+    len = strlen (name);
+    atom = g_malloc (sizeof (*atom) + len + 1);
+    atom->refs = 1;
+    atom->hash = hash;
+    atom->len = len;
+    memcpy (atom->buf, name, len + 1);
+    atom->str = atom->buf;
+
+    g_hash_table_add (names, atom);
+    name_bytes += sizeof (*atom) + len + 1;
+    return atom;
+}
+
+static
+void
+unref_name (struct nss_tls_name *atom)
+{
+    if (--atom->refs == 0) {
+        g_hash_table_remove (names, atom);
+        name_bytes -= sizeof (*atom) + atom->len + 1;
+        g_free (atom);
+    }
+}
+
+static
+guint
+get_sketch_index (const guint hash, const gint row)
+{
+    static const guint32 seeds[SKETCH_DEPTH] = {
+        0x9e3779b1, 0x85ebca77, 0xc2b2ae3d, 0x27d4eb2f
+    };
+
+    /* the high half of the product mixes all bits of the hash */
+    return (guint)(((guint64)hash * seeds[row]) >> 32) % sketch.width;
+}
+
+void
+nss_tls_cache_count_lookup (const guint hash)
+{
+    guint idx, j;
+    gint i;
+
+    if (cache_policy != NSS_TLS_CACHE_TINYLFU) {
+        return;
+    }
+
+    for (i = 0; i < SKETCH_DEPTH; ++i) {
+        idx = get_sketch_index (hash, i);
+        if (sketch.counters[i][idx] < SKETCH_MAX) {
+            ++sketch.counters[i][idx];
+        }
+    }
+
+    if (++sketch.lookups < sketch.age) {
+        return;
+    }
+
+    for (i = 0; i < SKETCH_DEPTH; ++i) {
+        for (j = 0; j < sketch.width; ++j) {
+            sketch.counters[i][j] >>= 1;
+        }
+    }
+
+    sketch.lookups = 0;
+}
+
+static
+guint8
+estimate_lookups (const guint hash)
+{
+    guint8 min = SKETCH_MAX;
+    gint i;
+
+    for (i = 0; i < SKETCH_DEPTH; ++i) {
+        min = MIN (min, sketch.counters[i][get_sketch_index (hash, i)]);
+    }
+
+    return min;
+}
+
+static
+void
+free_cache_entry (gpointer data)
+{
+    struct nss_tls_cache_entry *entry = data;
+
+    g_queue_unlink (entry->lru, &entry->link);
+    if (entry->cname) {
+        unref_name (entry->cname);
+    }
+    unref_name (entry->name);
+    g_free (entry);
+}
+
+static
+void
+move_cache_entry (struct nss_tls_cache_entry *entry, GQueue *lru)
+{
+    g_queue_unlink (entry->lru, &entry->link);
+    g_queue_push_head_link (lru, &entry->link);
+    entry->lru = lru;
+}
+
+void
+nss_tls_cache_init (const guint                        size,
+                    const enum nss_tls_cache_policy    policy,
+                    const gint64                       min,
+                    const gint64                       fallback)
+{
+    gint i;
+
+    for (i = 0; i < G_N_ELEMENTS (caches); ++i) {
+        caches[i].entries = g_hash_table_new_full (g_direct_hash,
+                                                   g_direct_equal,
+                                                   NULL,
+                                                   free_cache_entry);
+    }
+    names = g_hash_table_new (hash_name, equal_names);
+
+    cache_policy = policy;
+    cache_budget = size;
+    window_size = MAX (size / CACHE_WINDOW_SHARE, 1);
+    min_ttl = min * 1000000;
+    fallback_ttl = fallback * 1000000;
+
+    sketch.width = size * 4;
+    sketch.age = size * 10;
+    sketch.lookups = 0;
+    for (i = 0; i < SKETCH_DEPTH; ++i) {
+        sketch.counters[i] = g_malloc0 (sketch.width);
+    }
+}
+
+void
+nss_tls_cache_free (void)
+{
+    gint i;
+
+    if (!names) {
+        return;
+    }
+
+    for (i = G_N_ELEMENTS (caches) - 1; i >= 0; --i) {
+        g_hash_table_unref (caches[i].entries);
+        caches[i].entries = NULL;
+    }
+    g_hash_table_unref (names);
+    names = NULL;
+
+    for (i = 0; i < SKETCH_DEPTH; ++i) {
+        g_free (sketch.counters[i]);
+        sketch.counters[i] = NULL;
+    }
+}
+
+gboolean
+nss_tls_cache_enabled (void)
+{
+    return names != NULL;
+}
+
+static
+gboolean
+check_ttl (gpointer key,
+           gpointer value,
+           gpointer user_data)
+{
+    struct nss_tls_cache_entry *entry = value;
+    gint64 now = *(const gint64 *)user_data;
+
+    if (now > entry->expiry) {
+        g_debug ("Cache for %s has expired", entry->name->str);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+void
+nss_tls_cache_expire (const gint64 now)
+{
+    gint i;
+
+    for (i = 0; i < G_N_ELEMENTS (caches); ++i) {
+        if (caches[i].entries) {
+            g_hash_table_foreach_remove (caches[i].entries,
+                                         check_ttl,
+                                         (gpointer)&now);
+        }
+    }
+}
+
+void
+nss_tls_cache_flush (void)
+{
+    gint i;
+
+    for (i = 0; i < G_N_ELEMENTS (caches); ++i) {
+        if (caches[i].entries) {
+            g_hash_table_remove_all (caches[i].entries);
+        }
+    }
+}
+
+guint
+nss_tls_cache_remove (const gchar *name, const guint hash)
+{
+    const struct nss_tls_name *atom;
+    guint removed = 0;
+    gint i;
+
+    atom = nss_tls_find_name (name, hash);
+    if (!atom) {
+        return 0;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS (caches); ++i) {
+        if (caches[i].entries &&
+            g_hash_table_remove (caches[i].entries, atom)) {
+            ++removed;
+        }
+    }
+
+    return removed;
+}
+
+static
+gboolean
+check_suffix (gpointer key,
+              gpointer value,
+              gpointer user_data)
+{
+    const struct nss_tls_name *name = key;
+    const gchar *suffix = user_data;
+    gsize len = strlen (suffix);
+
+    if (name->len < len) {
+        return FALSE;
+    }
+
+    if (name->len == len) {
+        return strcmp (name->str, suffix) == 0;
+    }
+
+    return (name->str[name->len - len - 1] == '.') &&
+           (strcmp (name->str + name->len - len, suffix) == 0);
+}
+
+guint
+nss_tls_cache_remove_suffix (const gchar *suffix)
+{
+    guint removed = 0;
+    gint i;
+
+    for (i = 0; i < G_N_ELEMENTS (caches); ++i) {
+        if (caches[i].entries) {
+            removed += g_hash_table_foreach_remove (caches[i].entries,
+                                                    check_suffix,
+                                                    (gpointer)suffix);
+        }
+    }
+
+    return removed;
+}
+
+/* entries are visited from the most recently used */
+void
+nss_tls_cache_foreach (nss_tls_cache_func    func,
+                       gpointer              user_data)
+{
+    static const int afs[] = {AF_INET, AF_INET6};
+    GList *link;
+    gint i;
+
+    for (i = 0; i < G_N_ELEMENTS (caches); ++i) {
+        for (link = caches[i].window.head; link; link = link->next) {
+            func (afs[i], link->data, user_data);
+        }
+
+        for (link = caches[i].main.head; link; link = link->next) {
+            func (afs[i], link->data, user_data);
+        }
+    }
+}
+
+/* lookup frequencies are forgotten, since the sketch is sized for the cache */
+void
+nss_tls_cache_resize (const guint size)
+{
+    gint i;
+
+    window_size = MAX (size / CACHE_WINDOW_SHARE, 1);
+
+    sketch.width = size * 4;
+    sketch.age = size * 10;
+    sketch.lookups = 0;
+    for (i = 0; i < SKETCH_DEPTH; ++i) {
+        g_free (sketch.counters[i]);
+        sketch.counters[i] = g_malloc0 (sketch.width);
+    }
+
+    nss_tls_cache_set_budget (size);
+}
+
+/* we evict the least recently used entries, starting with the main LRU */
+void
+nss_tls_cache_set_budget (const guint budget)
+{
+    struct nss_tls_cache_entry *entry;
+    GQueue *lru;
+    gint i;
+
+    cache_budget = budget;
+
+    for (i = 0; i < G_N_ELEMENTS (caches); ++i) {
+        if (!caches[i].entries) {
+            continue;
+        }
+
+        while (g_hash_table_size (caches[i].entries) > cache_budget) {
+            lru = caches[i].main.length ? &caches[i].main : &caches[i].window;
+            entry = g_queue_peek_tail (lru);
+            g_hash_table_remove (caches[i].entries, entry->name);
+        }
+    }
+}
+
+guint
+nss_tls_cache_get_budget (void)
+{
+    return cache_budget;
+}
+
+static
+gint
+choose_cache (const int af)
+{
+    if (af == AF_INET) {
+        return 0;
+    }
+
+    return 1;
+}
+
+guint
+nss_tls_cache_get_size (const int af)
+{
+    gint i = choose_cache (af);
+
+    if (!caches[i].entries) {
+        return 0;
+    }
+
+    return g_hash_table_size (caches[i].entries);
+}
+
+/* each hash table node holds a key, a value and a hash */
+gsize
+nss_tls_cache_get_memory (void)
+{
+    gsize entries;
+
+    entries = nss_tls_cache_get_size (AF_INET) +
+              nss_tls_cache_get_size (AF_INET6);
+
+    return entries * (sizeof (struct nss_tls_cache_entry) +
+                      2 * sizeof (gpointer) +
+                      sizeof (guint)) +
+           name_bytes;
+}
+
+/*
+ * when the window is full, its least recently used entry competes with the
+ * least recently used entry of the main LRU and the less frequently looked up
+ * one is evicted; with the LRU policy, the window entry always wins
+ */
+static
+void
+evict_from_window (const gint i)
+{
+    struct nss_tls_cache_entry *candidate, *victim;
+    GList *link;
+
+    if (caches[i].window.length <= window_size) {
+        return;
+    }
+
+    link = g_queue_peek_tail_link (&caches[i].window);
+    candidate = link->data;
+
+    if (caches[i].main.length + window_size < cache_budget) {
+        move_cache_entry (candidate, &caches[i].main);
+        return;
+    }
+
+    link = g_queue_peek_tail_link (&caches[i].main);
+    if (!link) {
+        g_hash_table_remove (caches[i].entries, candidate->name);
+        return;
+    }
+    victim = link->data;
+
+    if ((cache_policy == NSS_TLS_CACHE_LRU) ||
+        (estimate_lookups (candidate->name->hash) >
+         estimate_lookups (victim->name->hash))) {
+        g_debug ("Evicting %s from the cache", victim->name->str);
+        g_hash_table_remove (caches[i].entries, victim->name);
+        move_cache_entry (candidate, &caches[i].main);
+    } else {
+        g_debug ("Evicting %s from the cache", candidate->name->str);
+        g_hash_table_remove (caches[i].entries, candidate->name);
+    }
+}
+
+static
+gint64
+get_expiry (const gint64 ttl, const gint64 min, const gint64 now)
+{
+    gint64 usecs;
+
+    if ((ttl < 0) || (ttl > INT64_MAX / 1000000)) {
+        return -1;
+    }
+
+    usecs = MAX (ttl * 1000000, min);
+    if (INT64_MAX - usecs < now) {
+        return -1;
+    }
+
+    return now + usecs;
+}
+
+/* this is independent of the cache, which may be disabled */
+gint64
+nss_tls_cache_get_expiry (const gint64 ttl, const gint64 now)
+{
+    return get_expiry (ttl, NSS_TLS_MIN_TTL * 1000000, now);
+}
+
+void
+nss_tls_cache_add (const int            af,
+                   const gchar          *name,
+                   const guint          hash,
+                   struct nss_tls_res   *res,
+                   const gint64         ttl,
+                   const gboolean       nxdomain,
+                   const gint64         now)
+{
+    struct nss_tls_cache_entry *entry;
+    struct nss_tls_name *cname = NULL;
+    guint chash;
+    gint i;
+
+    i = choose_cache (af);
+
+    if (!caches[i].entries) {
+        return;
+    }
+
+    if (res->expiry == -1) {
+        if (now > INT64_MAX - fallback_ttl) {
+            return;
+        }
+
+        res->expiry = now + fallback_ttl;
+    }
+
+    /* the canonical name is already normalized, but we need its hash */
+    if (res->cname[0] && nss_tls_normalize_name (res->cname, &chash)) {
+        cname = intern_name (res->cname, chash);
+    }
+
+    entry = g_hash_table_lookup (caches[i].entries,
+                                 nss_tls_find_name (name, hash));
+    if (entry) {
+        if (entry->cname) {
+            unref_name (entry->cname);
+        }
+    } else {
+        entry = g_new (struct nss_tls_cache_entry, 1);
+        entry->link.data = entry;
+        entry->link.prev = entry->link.next = NULL;
+        entry->name = intern_name (name, hash);
+
+        g_queue_push_head_link (&caches[i].window, &entry->link);
+        entry->lru = &caches[i].window;
+        g_hash_table_insert (caches[i].entries, entry->name, entry);
+    }
+
+    entry->cname = cname;
+    entry->expiry = (ttl >= 0) ? get_expiry (ttl, min_ttl, now) : -1;
+    if (entry->expiry == -1) {
+        entry->expiry = res->expiry;
+    }
+    entry->ttl = ttl;
+    entry->nxdomain = nxdomain;
+    entry->count = res->count;
+    memcpy (entry->addrs, res->addrs, res->count * sizeof (res->addrs[0]));
+
+    move_cache_entry (entry, entry->lru);
+    evict_from_window (i);
+
+    g_debug ("Caching %s until %"G_GINT64_FORMAT, name, entry->expiry);
+}
+
+struct nss_tls_cache_entry *
+nss_tls_cache_query (const int af, const struct nss_tls_name *name)
+{
+    struct nss_tls_cache_entry *entry;
+    gint i;
+
+    i = choose_cache (af);
+    if (!caches[i].entries || !name) {
+        return NULL;
+    }
+
+    entry = g_hash_table_lookup (caches[i].entries, name);
+    if (!entry) {
+        return NULL;
+    }
+
+    g_debug ("Found %s in the cache", name->str);
+    move_cache_entry (entry, entry->lru);
+
+    return entry;
+}
@@ -0,0 +1,165 @@
+/*
+ * This file is part of nss-tls.
+ *
+ * Copyright (C) 2018, 2019  Dima Krasner
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef _NSS_TLSD_CACHE_H_INCLUDED
+#define _NSS_TLSD_CACHE_H_INCLUDED
+
+#include <netinet/in.h>
+
+#include <glib.h>
+
+#include "nss-tls.h"
+
+/*
+ * the response cache of nss-tlsd, shared with tlscachesim: the cache has no
+ * clock of its own, so the simulator can replay a trace in virtual time
+ */
+#define NSS_TLS_MIN_TTL 10
+#define NSS_TLS_CACHE_SIZE 1024
+#define NSS_TLS_CACHE_CLEANUP_INTERVAL 5
+#define NSS_TLS_CACHE_MIN_TTL 10
+#define NSS_TLS_CACHE_FALLBACK_TTL 60
+
+enum nss_tls_cache_policy {
+    NSS_TLS_CACHE_TINYLFU,
+    NSS_TLS_CACHE_LRU
+};
+
+/*
+ * cached names and canonical names are interned: each name is stored once,
+ * normalized, with its hash
+ */
+struct nss_tls_name {
+    gint refs;
+    guint hash;
+    gsize len;
+    const gchar *str;
+    gchar buf[];
+};
+
+/*
+ * new entries go to a small LRU window; entries evicted from the window are
+ * admitted to the main LRU only if their name is looked up more frequently
+ * than the name of the entry they would evict, so names resolved once don't
+ * push out popular ones (W-TinyLFU)
+ */
+struct nss_tls_cache_entry {
+    GList link;
+    GQueue *lru;
+    struct nss_tls_name *name;
+    struct nss_tls_name *cname;
+    gint64 expiry;
+    gint64 ttl;
+    gboolean nxdomain;
+    guint8 count;
+    union {
+        struct in_addr in;
+        struct in6_addr in6;
+    } addrs[NSS_TLS_ADDRS_MAX];
+};
+
+gboolean
+nss_tls_normalize_name (gchar *name, guint *hash);
+
+struct nss_tls_name *
+nss_tls_find_name (const gchar *name, const guint hash);
+
+/* the TTLs are in seconds */
+void
+nss_tls_cache_init (const guint                        size,
+                    const enum nss_tls_cache_policy    policy,
+                    const gint64                       min_ttl,
+                    const gint64                       fallback_ttl);
+
+void
+nss_tls_cache_free (void);
+
+gboolean
+nss_tls_cache_enabled (void);
+
+void
+nss_tls_cache_count_lookup (const guint hash);
+
+/*
+ * returns the expiry time reported to clients for a response with the given
+ * TTL, at least NSS_TLS_MIN_TTL seconds from now, or -1 if none
+ */
+gint64
+nss_tls_cache_get_expiry (const gint64 ttl, const gint64 now);
+
+/*
+ * the response's expiry is set to now + the fallback TTL if it has none;
+ * ttl is the TTL of the response before the minimum TTL was applied, or -1,
+ * and the cached response expires after ttl or the minimum TTL of the cache;
+ * nxdomain is set if the name does not exist
+ */
+void
+nss_tls_cache_add (const int            af,
+                   const gchar          *name,
+                   const guint          hash,
+                   struct nss_tls_res   *res,
+                   const gint64         ttl,
+                   const gboolean       nxdomain,
+                   const gint64         now);
+
+struct nss_tls_cache_entry *
+nss_tls_cache_query (const int af, const struct nss_tls_name *name);
+
+void
+nss_tls_cache_expire (const gint64 now);
+
+void
+nss_tls_cache_flush (void);
+
+/* name must be normalized; returns the number of entries removed */
+guint
+nss_tls_cache_remove (const gchar *name, const guint hash);
+
+/* removes suffix and all names under it */
+guint
+nss_tls_cache_remove_suffix (const gchar *suffix);
+
+typedef void (*nss_tls_cache_func) (const int                           af,
+                                    const struct nss_tls_cache_entry    *entry,
+                                    gpointer                            user_data);
+
+void
+nss_tls_cache_foreach (nss_tls_cache_func    func,
+                       gpointer              user_data);
+
+/* sets the budget too */
+void
+nss_tls_cache_resize (const guint size);
+
+/* the budget is the maximum number of entries in each cache */
+void
+nss_tls_cache_set_budget (const guint budget);
+
+guint
+nss_tls_cache_get_budget (void);
+
+guint
+nss_tls_cache_get_size (const int af);
+
+/* an estimate of the memory used by cache entries and names, in bytes */
+gsize
+nss_tls_cache_get_memory (void);
+
+#endif
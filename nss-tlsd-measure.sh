@@ -0,0 +1,98 @@
+#!/bin/sh -e
+
+# This file is part of nss-tls.
+#
+# Copyright (C) 2019  Dima Krasner
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+# compares the startup time, idle RSS and CPU time per cached lookup of
+# nss-tlsd builds, e.g. with -Dfrontend=native and -Dfrontend=gio:
+#
+#   meson -Dfrontend=native build-native && ninja -C build-native
+#   meson -Dfrontend=gio build-gio && ninja -C build-gio
+#   ./nss-tlsd-measure.sh build-native build-gio
+#
+# each build runs with its own runtime directory, so another nss-tlsd
+# instance does not interfere; the first lookup needs a working DoH server
+
+NAME=${NAME:-example.com}
+LOOKUPS=${LOOKUPS:-5000}
+
+if [ $# -eq 0 ] || [ `id -u` -eq 0 ]
+then
+    echo "Usage: $0 BUILD..." >&2
+    echo "Run as an unprivileged user." >&2
+    exit 1
+fi
+
+now_ns() {
+    date +%s%N
+}
+
+# the user and system time of a process, in clock ticks
+cpu_ticks() {
+    awk '{print $14 + $15}' /proc/$1/stat
+}
+
+measure() {
+    build=$1
+    export XDG_RUNTIME_DIR=`mktemp -d`
+    export LD_LIBRARY_PATH=$build
+
+    start=`now_ns`
+    $build/nss-tlsd -c > /dev/null 2>&1 &
+    pid=$!
+    while [ ! -S $XDG_RUNTIME_DIR/nss-tlsd.sock ]
+    do
+        kill -0 $pid
+        sleep 0.001
+    done
+    startup=$(((`now_ns` - start) / 1000000))
+
+    sleep 1
+    rss=`awk '/^VmRSS:/ {print $2}' /proc/$pid/status`
+
+    # the first lookup fills the cache
+    $build/tlslookup $NAME > /dev/null
+
+    before=`cpu_ticks $pid`
+    i=0
+    while [ $i -lt $LOOKUPS ]
+    do
+        $build/tlslookup $NAME > /dev/null
+        i=$((i + 1))
+    done
+    ticks=$((`cpu_ticks $pid` - before))
+
+    kill $pid
+    wait $pid 2> /dev/null || :
+    rm -rf $XDG_RUNTIME_DIR
+
+    awk -v build=$build \
+        -v startup=$startup \
+        -v rss=$rss \
+        -v ticks=$ticks \
+        -v lookups=$LOOKUPS \
+        -v hz=`getconf CLK_TCK` \
+        'BEGIN {printf "%-24s %12u %12u %16.2f\n", build, startup, rss, ticks * 1000000 / hz / lookups}'
+}
+
+printf "%-24s %12s %12s %16s\n" build startup_ms idle_rss_kib cpu_us/lookup
+
+for build in "$@"
+do
+    measure $build
+done
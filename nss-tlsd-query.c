@@ -0,0 +1,258 @@
+/*
+ * This file is part of nss-tls.
+ *
+ * Copyright (C) 2018, 2019  Dima Krasner
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <string.h>
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+#include <glib.h>
+
+#include "nss-tls.h"
+#include "nss-tlsd-cache.h"
+#include "nss-tlsd-query.h"
+
+int
+nss_tls_make_query (const gchar     *name,
+                    const int       af,
+                    unsigned char   *buf,
+                    const gsize     size,
+                    int             *type)
+{
+    int len;
+
+    switch (af) {
+    case AF_INET:
+        *type = ns_t_a;
+        break;
+
+    case AF_INET6:
+        *type = ns_t_aaaa;
+        break;
+
+    default:
+        return -1;
+    }
+
+    len = res_mkquery (QUERY,
+                       name,
+                       ns_c_in,
+                       *type,
+                       NULL,
+                       0,
+                       NULL,
+                       buf,
+                       (int)size);
+    if (len <= 1) {
+        return -1;
+    }
+
+    return len;
+}
+
+gchar *
+nss_tls_encode_query (const unsigned char *buf, const gsize len)
+{
+    gchar *b64, *p;
+
+    b64 = g_base64_encode (buf, len);
+
+    /* https://tools.ietf.org/html/rfc4648#section-5 */
+    for (p = b64; *p; ++p) {
+        switch (*p) {
+        case '+':
+            *p = '-';
+            break;
+
+        case '/':
+            *p = '_';
+            break;
+
+        case '=':
+            *p = '\0';
+            return b64;
+        }
+    }
+
+    return b64;
+}
+
+static
+void
+parse_answer (const gchar           *name,
+              const unsigned char   *dns,
+              const gsize           len,
+              ns_msg                *msg,
+              const int             rr_id,
+              const int             a_type,
+              const size_t          addrlen,
+              const gboolean        canon,
+              struct nss_tls_res    *res,
+              gint64                *ttl,
+              const gint64          now)
+{
+    ns_rr rr;
+    gint64 rr_ttl, expiry;
+    guint hash;
+    int type;
+
+    if (ns_parserr (msg, ns_s_an, rr_id, &rr) < 0) {
+        g_warning ("Failed to parse a result record for %s", name);
+        return;
+    }
+
+    if (ns_rr_class (rr) != ns_c_in)
+        return;
+
+    type = ns_rr_type (rr);
+    if (type == a_type) {
+        if (ns_rr_rdlen (rr) == addrlen) {
+            memcpy (&res->addrs[res->count], ns_rr_rdata (rr), addrlen);
+            ++res->count;
+
+            rr_ttl = (gint64)ns_rr_ttl (rr);
+            expiry = nss_tls_cache_get_expiry (rr_ttl, now);
+
+            /*
+             * after looking at all answer records, we use the shortest TTL
+             * for all answers; expiry times are rounded up to the minimum TTL,
+             * so we track the shortest TTL separately
+             */
+            if (expiry != -1) {
+                if ((res->expiry == -1) || (expiry < res->expiry)) {
+                    res->expiry = expiry;
+                }
+
+                if ((*ttl == -1) || (rr_ttl < *ttl)) {
+                    *ttl = rr_ttl;
+                }
+            }
+        }
+    }
+    else if (!canon &&
+             (type == ns_t_cname) &&
+             !res->cname[0] &&
+             (ns_rr_rdlen (rr) > 0)) {
+        if ((dn_expand (dns,
+                        dns + len,
+                        ns_rr_rdata (rr),
+                        res->cname,
+                        sizeof (res->cname)) <= 0) ||
+            !nss_tls_normalize_name (res->cname, &hash)) {
+            res->cname[0] = '\0';
+        }
+    }
+}
+
+gboolean
+nss_tls_parse_response (const gchar          *name,
+                        const unsigned char  *dns,
+                        const gsize          len,
+                        const int            af,
+                        const gboolean       canon,
+                        struct nss_tls_res   *res,
+                        gint64               *ttl,
+                        const gint64         now)
+{
+    ns_msg msg;
+    size_t addrlen;
+    int id, count, a_type;
+
+    switch (af) {
+    case AF_INET:
+        a_type = ns_t_a;
+        addrlen = sizeof (res->addrs[0].in);
+        break;
+
+    case AF_INET6:
+        a_type = ns_t_aaaa;
+        addrlen = sizeof (res->addrs[0].in6);
+        break;
+
+    default:
+        return FALSE;
+    }
+
+    if (ns_initparse (dns, (int)len, &msg) < 0) {
+        g_warning ("Failed to parse the result for %s", name);
+        return FALSE;
+    }
+
+    count = ns_msg_count(msg, ns_s_an);
+    for (id = 0;
+         ((id < count) &&
+          ((res->count < G_N_ELEMENTS (res->addrs)) || !res->cname[0]));
+         ++id) {
+        parse_answer (name,
+                      dns,
+                      len,
+                      &msg,
+                      id,
+                      a_type,
+                      addrlen,
+                      canon,
+                      res,
+                      ttl,
+                      now);
+    }
+
+    return TRUE;
+}
+
+/*
+ * we don't want to leak the local domain to the DoH server provider (for
+ * example, it may indicate a router model) and we don't want to waste time on
+ * this query if it's going to fail anyway
+ */
+gboolean
+nss_tls_is_suffixed (const gchar *name)
+{
+    struct __res_state res;
+    gchar *suffix;
+    gboolean ret = FALSE;
+    guint i;
+
+    if (res_ninit (&res) < 0) {
+        return FALSE;
+    }
+
+    for (i = 0; (i < G_N_ELEMENTS (res.dnsrch)) && res.dnsrch[i]; ++i) {
+        suffix = g_strconcat (".", res.dnsrch[i], NULL);
+        ret = g_str_has_suffix (name, suffix);
+        g_free (suffix);
+        if (ret) {
+            g_debug ("%s is suffixed by a local domain", name);
+            break;
+        }
+    }
+
+    res_nclose (&res);
+    return ret;
+}
+
+guint
+nss_tls_hash_resolver (const gchar *name, const guint count)
+{
+    if (count <= 1) {
+        return 0;
+    }
+
+    return g_str_hash (name) % count;
+}
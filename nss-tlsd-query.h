@@ -0,0 +1,69 @@
+/*
+ * This file is part of nss-tls.
+ *
+ * Copyright (C) 2018, 2019  Dima Krasner
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef _NSS_TLSD_QUERY_H_INCLUDED
+#define _NSS_TLSD_QUERY_H_INCLUDED
+
+#include <glib.h>
+
+#include "nss-tls.h"
+
+/*
+ * building, encoding and parsing of DNS messages sent to DoH servers, shared
+ * with nss-tlsd-bench
+ */
+
+/* returns the query length, or -1 if the name or address family is bad */
+int
+nss_tls_make_query (const gchar     *name,
+                    const int       af,
+                    unsigned char   *buf,
+                    const gsize     size,
+                    int             *type);
+
+/* encodes a query for GET requests, using base64url without padding */
+gchar *
+nss_tls_encode_query (const unsigned char *buf, const gsize len);
+
+/*
+ * adds the addresses and the canonical name (unless canon is set) in a
+ * response to res; ttl is set to the shortest TTL of all addresses, before
+ * any minimum TTL is applied, or -1; returns FALSE if the response cannot be
+ * parsed
+ */
+gboolean
+nss_tls_parse_response (const gchar          *name,
+                        const unsigned char  *dns,
+                        const gsize          len,
+                        const int            af,
+                        const gboolean       canon,
+                        struct nss_tls_res   *res,
+                        gint64               *ttl,
+                        const gint64         now);
+
+/* returns TRUE if name ends with a search domain from resolv.conf */
+gboolean
+nss_tls_is_suffixed (const gchar *name);
+
+/* returns the index of the DoH server name is sent to, out of count */
+guint
+nss_tls_hash_resolver (const gchar *name, const guint count);
+
+#endif
@@ -18,9 +18,13 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
  */
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <pwd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -28,7 +32,10 @@
 #include <grp.h>
 #include <errno.h>
 #include <limits.h>
+#include <malloc.h>
+#include <sys/mman.h>
 #include <string.h>
+#include <stdio.h>
 #include <netinet/in.h>
 #include <resolv.h>
 
@@ -39,23 +46,67 @@
 #include <gio/gunixsocketaddress.h>
 #include <gmodule.h>
 #include <libsoup/soup.h>
+#ifdef NSS_TLS_URING
+#include <liburing.h>
+#endif
 
 #include "nss-tls.h"
+#include "nss-tlsd-cache.h"
+#include "nss-tlsd-query.h"
 
-#define CACHE_CLEANUP_INTERVAL 5
-#define FALLBACK_TTL (60 * 1000000)
-#define MIN_TTL 10
-#define CACHE_SIZE 1024
+#define MIN_CACHE_BUDGET MAX (cache_size / 16, 1)
+#define PSI_TRIGGER "some 150000 2000000"
+#define PSI_RECOVERY_TIME (30 * 1000000)
+#define MIN_CONNS_PER_RESOLVER 1
 #define MAX_CONNS_PER_RESOLVER 10
-#define MAX_RESOLVERS 16
+#define POOL_RESIZE_INTERVAL 1
+#define DEFAULT_RETRY_AFTER 5
+#define MAX_RETRY_AFTER 300
 #define MAX_REQ_SIZE 512
+#define HTTP_MAX_HEAD 4096
+#define HTTP_PIPELINE_DEPTH 8
+#define HTTP_TOO_MANY_REQUESTS 429
+#define HOST_CACHE_TTL (300 * 1000000)
+#define NETWORK_CHANGE_DELAY 1
+#define AUTO_METHOD_EXPLORE 0.05
+#define STUB_BATCH 32
+#define QUERY_LOG_SIZE 4096
+#define QUERY_LOG_SERVER_MAX 64
+#define QUERY_LOG_FLUSH_INTERVAL (1 * 1000000)
+#define STUB_UDP_SIZE 512
+#define MIN_CACHE_SIZE 16
+#define MAX_CACHE_SIZE (1024 * 1024)
+
+enum nss_tls_clients {
+    NSS_TLS_CLIENT_SOUP,
+    NSS_TLS_CLIENT_NATIVE
+};
 
 enum nss_tls_methods {
     NSS_TLS_METHOD_POST,
     NSS_TLS_METHOD_MIN = NSS_TLS_METHOD_POST,
     NSS_TLS_METHOD_GET,
     NSS_TLS_METHOD_MAX,
-    NSS_TLS_METHOD_RANDOM
+    NSS_TLS_METHOD_RANDOM,
+    NSS_TLS_METHOD_AUTO
+};
+
+struct nss_tls_stub_conn {
+    GSocketConnection *connection;
+    guint16 len;
+    unsigned char buf[2 + UINT16_MAX];
+};
+
+struct nss_tls_stub_query {
+    struct nss_tls_stub_conn *conn;
+    gint fd;
+    struct sockaddr_storage peer;
+    socklen_t peerlen;
+    guint16 id;
+    gboolean rd;
+    gsize qlen;
+    unsigned char question[NS_MAXCDNAME + NS_QFIXEDSZ];
+    gsize alen;
 };
 
 struct nss_tls_session {
@@ -63,715 +114,4882 @@ struct nss_tls_session {
     struct nss_tls_req request;
     struct nss_tls_res response;
     gint64 type;
+#ifdef NSS_TLS_GIO_FRONTEND
     GSocketConnection *connection;
+#else
+    int fd;
+    guint watch;
+    gsize off;
+    gint64 deadline;
+    GList link;
+#ifdef NSS_TLS_URING
+    gboolean uring;
+#endif
+#endif
+    struct nss_tls_stub_query *stub;
     SoupMessage *message;
+    gsize qlen;
+    struct nss_tls_resolver *resolver;
+    gint method;
+    gint64 sent;
+    gboolean inflight;
+    gboolean throttled;
+    gboolean retried;
     gboolean canon;
+    gboolean nxdomain;
+    guint hash;
+    gint64 accepted;
+    gint64 ttl;
+    gchar origin[NS_MAXDNAME];
+    gboolean preload;
 };
 
-static SoupSession *soup = NULL;
-static struct {
+/*
+ * resolvers are shared by generations of the configuration and by the queries
+ * sent to them, so a resolver that outlives a configuration change keeps its
+ * connections and statistics, and queries in flight outlive the configuration
+ * they were sent with
+ */
+struct nss_tls_resolver {
+    gint refs;
     gchar *url;
-    const gchar *domain;
+    gchar *domain;
     enum nss_tls_methods method;
-} resolvers[MAX_RESOLVERS];
-gint32 nresolvers = 0;
+    guint inflight;
+    guint peak;
+    guint queries;
+    gint64 latency;
+    gint64 method_latency[NSS_TLS_METHOD_MAX];
+    gint conns;
+    gdouble tokens;
+    gint64 refilled;
+    gint64 blocked;
+    guint throttled;
+    guint limited;
+};
+
+static SoupSession *soup = NULL;
+static GPtrArray *resolvers = NULL;
+static enum nss_tls_clients client = NSS_TLS_CLIENT_SOUP;
+static gint min_conns = MIN_CONNS_PER_RESOLVER;
+static gint max_conns = MAX_CONNS_PER_RESOLVER;
+static gint qps = 0;
+static gint burst = 0;
+static GQueue throttled = G_QUEUE_INIT;
+static guint throttle_timer = 0;
+static GQueue queued[NSS_TLS_PRIO_MAX] = {
+    G_QUEUE_INIT, G_QUEUE_INIT, G_QUEUE_INIT
+};
+static guint dispatch_source = 0;
+static guint inflight = 0;
 
 static gboolean cache = FALSE;
 static gboolean randomize = FALSE;
-static GHashTable *caches[2] = {NULL, NULL};
-static GFile *cfg_file = NULL;
-static GFileMonitor *cfg_monitor = NULL;
+static gboolean flush_on_network_change = FALSE;
+static guint network_timer = 0;
+static gchar *listen_addr = NULL;
+static gchar *query_log_path = NULL;
 
-static
-gboolean
-check_ttl (gpointer key,
-           gpointer value,
-           gpointer user_data)
-{
-    const gchar *name = (const gchar *)key;
-    struct nss_tls_res *res = (struct nss_tls_res *)value;
-    gint64 now = *(gint64 *)user_data;
+/* the cache shrinks under memory pressure and grows back once it subsides */
+static gint64 pressure_time = 0;
+static guint cache_size = NSS_TLS_CACHE_SIZE;
 
-    if (now > res->expiry) {
-        g_debug ("Cache for %s has expired", name);
-        return TRUE;
-    }
+/* messages less severe than this are dropped */
+static GLogLevelFlags log_level = G_LOG_LEVEL_DEBUG;
 
-    return FALSE;
-}
+static GFile *cfg_file = NULL;
+static GFileMonitor *cfg_monitor = NULL;
+static struct nss_tls_filter *filter = NULL;
+static GFileMonitor *resolv_monitor = NULL;
 
 static
 gboolean
 on_cache_cleanup (gpointer user_data)
 {
     gint64 now;
-    gint i;
+    guint budget;
 
     now = g_get_monotonic_time ();
 
-    for (i = 0; i < G_N_ELEMENTS (caches); ++i) {
-        g_hash_table_foreach_remove (caches[i], check_ttl, &now);
+    nss_tls_cache_expire (now);
+
+    /* we grow the cache back gradually, once memory pressure subsides */
+    budget = nss_tls_cache_get_budget ();
+    if ((budget < cache_size) &&
+        (now - pressure_time >= PSI_RECOVERY_TIME)) {
+        budget = MIN (budget * 2, cache_size);
+        g_debug ("Growing the cache to %u entries", budget);
+        nss_tls_cache_set_budget (budget);
+        pressure_time = now;
     }
 
     return TRUE;
 }
 
 static
-GHashTable *
-choose_cache (const int af)
+void
+add_to_cache (struct nss_tls_session *session)
 {
-    if (af == AF_INET) {
-        return caches[0];
-    }
-
-    return caches[1];
+    nss_tls_cache_add (session->request.af,
+                       session->request.name,
+                       session->hash,
+                       &session->response,
+                       session->ttl,
+                       session->nxdomain,
+                       g_get_monotonic_time ());
 }
 
 static
-void
-add_to_cache (const struct nss_tls_req *req, struct nss_tls_res *res)
+gboolean
+get_cached_response (struct nss_tls_session *session)
 {
-    gchar *key;
-    struct nss_tls_res *val;
-    gint64 now;
-    GHashTable *cache;
+    const struct nss_tls_cache_entry *entry, *centry;
 
-    cache = choose_cache (req->af);
+    if (!nss_tls_cache_enabled ()) {
+        return FALSE;
+    }
 
-    if (!cache || (g_hash_table_size (cache) >= CACHE_SIZE)) {
-        return;
+    nss_tls_cache_count_lookup (session->hash);
+
+    entry = nss_tls_cache_query (session->request.af,
+                                 nss_tls_find_name (session->request.name,
+                                                    session->hash));
+    if (!entry) {
+        NSS_TLS_PROBE (cache_miss,
+                       session->request.name,
+                       session->request.af);
+        return FALSE;
     }
 
-    if (res->expiry == -1) {
-        now = g_get_monotonic_time ();
-        if (now > INT64_MAX - FALLBACK_TTL) {
-            return;
-        }
+    if (entry->cname) {
+        strcpy (session->response.cname, entry->cname->str);
 
-        res->expiry = now + FALLBACK_TTL;
+        centry = nss_tls_cache_query (session->request.af, entry->cname);
+        if (centry) {
+            entry = centry;
+        }
+    } else {
+        session->response.cname[0] = '\0';
     }
 
-    key = g_strdup (req->name);
-    val = g_memdup (res, sizeof (*res));
+    memcpy (session->response.addrs,
+            entry->addrs,
+            entry->count * sizeof (entry->addrs[0]));
+    session->response.count = entry->count;
+    session->response.expiry = entry->expiry;
+    session->ttl = entry->ttl;
+    session->nxdomain = entry->nxdomain;
 
-    g_hash_table_insert (cache, key, val);
-    g_debug ("Caching %s until %"G_GINT64_FORMAT, req->name, res->expiry);
+    NSS_TLS_PROBE (cache_hit,
+                   session->request.name,
+                   session->request.af,
+                   session->response.count);
+    return TRUE;
 }
 
 static
-const struct nss_tls_res *
-query_cache (const int af, const char *name)
+void
+on_response (GObject         *source_object,
+             GAsyncResult    *res,
+             gpointer        user_data);
+
+static
+void
+stub_reply (struct nss_tls_session *session, const int rcode);
+
+static
+void
+reply_to_client (struct nss_tls_session *session);
+
+static
+void
+free_session (struct nss_tls_session *session);
+
+static
+void
+close_client (struct nss_tls_session *session);
+
+/*
+ * the query log is a ring of fixed-size records, filled by the main thread and
+ * written to a file by a thread of its own, without locks: only the main
+ * thread advances the head and only the other thread advances the tail;
+ * records are dropped if the file cannot keep up
+ */
+struct nss_tls_log_slot {
+    struct nss_tls_log_entry entry;
+    gchar name[G_MAXUINT8];
+    gchar server[QUERY_LOG_SERVER_MAX];
+};
+
+static struct {
+    struct nss_tls_log_slot slots[QUERY_LOG_SIZE];
+    guint head;
+    guint tail;
+    guint dropped;
+    gboolean stop;
+    FILE *fp;
+    GThread *thread;
+} *query_log = NULL;
+
+static
+gpointer
+flush_query_log (gpointer data)
 {
-    gpointer res = NULL;
-    GHashTable *cache;
+    const struct nss_tls_log_slot *slot;
+    guint head, tail;
+    gboolean stop;
+
+    do {
+        stop = __atomic_load_n (&query_log->stop, __ATOMIC_ACQUIRE);
+        head = __atomic_load_n (&query_log->head, __ATOMIC_ACQUIRE);
+
+        for (tail = query_log->tail; tail != head; ++tail) {
+            slot = &query_log->slots[tail % QUERY_LOG_SIZE];
+            fwrite (&slot->entry, sizeof (slot->entry), 1, query_log->fp);
+            fwrite (slot->name, slot->entry.name_len, 1, query_log->fp);
+            fwrite (slot->server, slot->entry.server_len, 1, query_log->fp);
+        }
 
-    cache = choose_cache (af);
-    if (cache) {
-        res = g_hash_table_lookup (cache, name);
-        if (res) {
-            g_debug ("Found %s in the cache", name);
+        __atomic_store_n (&query_log->tail, tail, __ATOMIC_RELEASE);
+        fflush (query_log->fp);
+
+        if (!stop) {
+            g_usleep (QUERY_LOG_FLUSH_INTERVAL);
         }
-    }
+    } while (!stop);
 
-    return (const struct nss_tls_res *)res;
+    return NULL;
 }
 
+/* we append to the log, so it survives restarts */
 static
 gboolean
-get_cached_response (struct nss_tls_session *session)
+open_query_log (const gchar *path)
 {
-    const struct nss_tls_res *res, *cres;
+    const struct nss_tls_log_header header = {
+        .magic = NSS_TLS_LOG_MAGIC,
+        .version = NSS_TLS_LOG_VERSION
+    };
+    struct stat stbuf;
+    FILE *fp;
+    int fd;
+
+    fd = open (path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        g_warning ("Failed to open %s: %s", path, g_strerror (errno));
+        return FALSE;
+    }
 
-    res = query_cache (session->request.af, session->request.name);
-    if (!res) {
+    fp = fdopen (fd, "a");
+    if (!fp) {
+        close (fd);
         return FALSE;
     }
 
-    if (res->cname[0]) {
-        cres = query_cache (session->request.af, res->cname);
-        if (cres) {
-            memcpy (session->response.addrs,
-                    cres->addrs,
-                    cres->count * sizeof(cres->addrs[0]));
-            session->response.count = cres->count;
-            session->response.expiry = cres->expiry;
-            strcpy (session->response.cname, res->cname);
-            return TRUE;
-        }
+    if ((fstat (fd, &stbuf) < 0) ||
+        ((stbuf.st_size == 0) && (fwrite (&header, sizeof (header), 1, fp) != 1))) {
+        fclose (fp);
+        return FALSE;
     }
 
-    memcpy (&session->response, res, sizeof (session->response));
+    query_log = g_malloc0 (sizeof (*query_log));
+    query_log->fp = fp;
+    query_log->thread = g_thread_new ("query-log", flush_query_log, NULL);
+
     return TRUE;
 }
 
 static
 void
-on_response (GObject         *source_object,
-             GAsyncResult    *res,
-             gpointer        user_data);
+close_query_log (void)
+{
+    if (!query_log) {
+        return;
+    }
 
-static
-void
-on_sent (GObject         *source_object,
-         GAsyncResult    *res,
-         gpointer        user_data);
+    __atomic_store_n (&query_log->stop, TRUE, __ATOMIC_RELEASE);
+    g_thread_join (query_log->thread);
+
+    fclose (query_log->fp);
+    g_free (query_log);
+    query_log = NULL;
+}
 
+/* returns 0 for DNS clients */
 static
-gchar *
-encode_dns_query (const unsigned char *buf, const gsize len)
+guint32
+get_client_pid (const struct nss_tls_session *session)
 {
-    gchar *b64;
-    size_t i;
+    struct ucred cred;
+    socklen_t len = sizeof (cred);
+    int fd;
 
-    b64 = g_base64_encode (buf, len);
-
-    /* https://tools.ietf.org/html/rfc4648#section-5 */
-    for (i = 0; i < strlen (b64); ++i) {
-        switch (b64[i]) {
-        case '+':
-            b64[i] = '-';
-            break;
+    if (session->stub || session->preload) {
+        return 0;
+    }
 
-        case '/':
-            b64[i] = '_';
-            break;
+#ifdef NSS_TLS_GIO_FRONTEND
+    fd = g_socket_get_fd (g_socket_connection_get_socket (session->connection));
+#else
+    fd = session->fd;
+#endif
 
-        case '=':
-            b64[i] = '\0';
-            return b64;
-        }
+    if (getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+        return 0;
     }
 
-    return b64;
+    return (guint32)cred.pid;
 }
 
 static
-gboolean
-resolve_domain (struct nss_tls_session *session)
+void
+log_query (const struct nss_tls_session *session, const gboolean ok)
 {
-    static unsigned char sbuf[MAX_REQ_SIZE];
-    unsigned char *buf = sbuf;
-    g_autofree gchar *url = NULL, *dns = NULL;
-    GOutputStream *out;
-    int type, len;
-    SoupMessageFlags flags;
-    guint id = 0;
-    gint method;
+    struct nss_tls_log_slot *slot;
+    const gchar *name, *server = "";
+    guint head;
 
-    if (get_cached_response (session)) {
-        out = g_io_stream_get_output_stream (G_IO_STREAM (session->connection));
-        g_output_stream_write_all_async (out,
-                                         &session->response,
-                                         sizeof (session->response),
-                                         G_PRIORITY_DEFAULT,
-                                         NULL,
-                                         on_sent,
-                                         session);
-        return TRUE;
+    if (!query_log) {
+        return;
     }
 
-    switch (session->request.af) {
-    case AF_INET:
-        type = ns_t_a;
-        break;
-
-    case AF_INET6:
-        type = ns_t_aaaa;
-        break;
-
-    default:
-        return FALSE;
+    head = query_log->head;
+    if (head - __atomic_load_n (&query_log->tail, __ATOMIC_ACQUIRE) ==
+        QUERY_LOG_SIZE) {
+        ++query_log->dropped;
+        return;
     }
 
-    if (randomize) {
-        id = g_random_int_range (0, nresolvers);
-    } else if (nresolvers > 1) {
-        id = g_str_hash (session->request.name) % nresolvers;
+    name = session->origin[0] ? session->origin : session->request.name;
+    if (session->resolver) {
+        server = session->resolver->domain;
     }
 
-    if (resolvers[id].method == NSS_TLS_METHOD_RANDOM) {
-        method = g_random_int_range (NSS_TLS_METHOD_MIN, NSS_TLS_METHOD_MAX);
+    slot = &query_log->slots[head % QUERY_LOG_SIZE];
+    slot->entry.time = g_get_real_time ();
+    slot->entry.latency = (guint32)MIN (g_get_monotonic_time () -
+                                        session->accepted,
+                                        G_MAXUINT32);
+    slot->entry.client = get_client_pid (session);
+    if ((session->ttl < 0) || (session->ttl >= NSS_TLS_LOG_NO_TTL)) {
+        slot->entry.ttl = NSS_TLS_LOG_NO_TTL;
     } else {
-        method = (gint)resolvers[id].method;
-    }
-
-    if (method == NSS_TLS_METHOD_POST) {
-        buf = g_malloc (MAX_REQ_SIZE);
-    }
-
-    len = res_mkquery (QUERY,
-                       session->request.name,
-                       ns_c_in,
-                       type,
-                       NULL,
-                       0,
-                       NULL,
-                       buf,
-                       MAX_REQ_SIZE);
-    if (len <= 1) {
-        if (method == NSS_TLS_METHOD_POST) {
-            g_free (buf);
-        }
-        return FALSE;
+        slot->entry.ttl = (guint32)session->ttl;
     }
-
-    /*
-     * always use 0 for the transaction ID, to improve the server's cache hit
-     * rate
-     */
-    buf[0] = buf[1] = 0;
-
-    if (nresolvers > 1) {
-        g_debug ("Resolving %s (%s) using %s",
-                 session->request.name,
-                 (session->request.af == AF_INET) ? "IPv4" : "IPv6",
-                 resolvers[id].url);
+    slot->entry.af = (guint8)session->request.af;
+    slot->entry.count = session->response.count;
+
+    /* a lookup is cached unless we had to send at least one query */
+    if (!ok) {
+        slot->entry.result = NSS_TLS_LOG_FAILED;
+    } else if (session->resolver) {
+        slot->entry.result = NSS_TLS_LOG_RESOLVED;
     } else {
-        g_debug ("Resolving %s (%s)",
-                 session->request.name,
-                 (session->request.af == AF_INET) ? "IPv4" : "IPv6");
+        slot->entry.result = NSS_TLS_LOG_CACHED;
     }
 
-    session->response.cname[0] = '\0';
-    session->type = (gint64)type;
+    slot->entry.name_len = (guint8)MIN (strlen (name), sizeof (slot->name));
+    memcpy (slot->name, name, slot->entry.name_len);
+    slot->entry.server_len = (guint8)MIN (strlen (server),
+                                          sizeof (slot->server));
+    memcpy (slot->server, server, slot->entry.server_len);
 
-    if (method == NSS_TLS_METHOD_POST) {
-        session->message = soup_message_new ("POST", resolvers[id].url);
-    } else {
-        dns = encode_dns_query (buf, (gsize)len);
-        url = g_strdup_printf ("%s?dns=%s", resolvers[id].url, dns);
+    __atomic_store_n (&query_log->head, head + 1, __ATOMIC_RELEASE);
+}
 
-        session->message = soup_message_new ("GET", url);
-    }
+static
+void
+send_response (struct nss_tls_session *session)
+{
+    NSS_TLS_PROBE (reply,
+                   session->request.name,
+                   session->request.af,
+                   session->response.count,
+                   g_get_monotonic_time () - session->accepted);
 
-    flags = soup_message_get_flags (session->message);
-    soup_message_set_flags (session->message, flags | SOUP_MESSAGE_IDEMPOTENT);
+    log_query (session, TRUE);
 
-    if (method == NSS_TLS_METHOD_POST) {
-        soup_message_set_request (session->message,
-                                  "application/dns-message",
-                                  SOUP_MEMORY_TAKE,
-                                  (const char *)buf,
-                                  (gsize)len);
+    if (session->stub) {
+        stub_reply (session,
+                    session->nxdomain ? ns_r_nxdomain : ns_r_noerror);
+        return;
     }
 
-    soup_message_headers_append (session->message->request_headers,
-                                 "Accept",
-                                 "application/dns-message");
+    if (session->preload) {
+        free_session (session);
+        return;
+    }
 
-    soup_session_send_async (soup,
-                             session->message,
-                             NULL,
-                             on_response,
-                             session);
+    reply_to_client (session);
+}
 
-    return TRUE;
+static
+struct nss_tls_resolver *
+ref_resolver (struct nss_tls_resolver *resolver)
+{
+    ++resolver->refs;
+    return resolver;
 }
 
 static
 void
-resolve_cname (struct nss_tls_session *session)
+unref_resolver (gpointer data)
 {
-    g_debug ("The canonical name of %s is %s",
-             session->request.name,
-             session->response.cname);
-    strcpy (session->request.name, session->response.cname);
+    struct nss_tls_resolver *resolver = (struct nss_tls_resolver *)data;
 
-    /*
-     * ignore CNAME records for this name; we don't want to be stuck in an
-     * infinite loop if the canonical form of A is B, while B has a CNAME record
-     * that points back to A
-     */
-    session->canon = TRUE;
+    if (--resolver->refs > 0) {
+        return;
+    }
 
-    resolve_domain (session);
+    g_free (resolver->domain);
+    g_free (resolver->url);
+    g_free (resolver);
 }
 
 static
 void
-on_close (GObject       *source_object,
-          GAsyncResult  *res,
-          gpointer      user_data)
+free_session (struct nss_tls_session *session)
 {
-    struct nss_tls_session *session = (struct nss_tls_session *)user_data;
+    if (session->resolver) {
+        unref_resolver (session->resolver);
+    }
 
-    g_io_stream_close_finish (G_IO_STREAM (source_object), res, NULL);
+    g_free (session);
+}
 
-    g_object_unref (session->connection);
+/*
+ * libsoup sends one request at a time over each connection, while the native
+ * client sends up to HTTP_PIPELINE_DEPTH requests
+ */
+static
+guint
+get_conn_capacity (void)
+{
+    if (client == NSS_TLS_CLIENT_NATIVE) {
+        return HTTP_PIPELINE_DEPTH;
+    }
 
-    g_free (session);
+    return 1;
 }
 
 static
 void
-stop_session (struct nss_tls_session *session)
+apply_pool_sizes (void)
 {
-    g_io_stream_close_async (G_IO_STREAM (session->connection),
-                             G_PRIORITY_DEFAULT,
-                             NULL,
-                             on_close,
-                             session);
+    struct nss_tls_resolver *resolver;
+    gint total = 0, per_host = 0;
+    guint i;
+
+    for (i = 0; i < resolvers->len; ++i) {
+        resolver = g_ptr_array_index (resolvers, i);
+        total += resolver->conns;
+        per_host = MAX (per_host, resolver->conns);
+    }
+
+    /*
+     * libsoup has no per-host limit, so we use the limit of the busiest
+     * resolver
+     */
+    if (soup && total > 0) {
+        g_object_set (soup,
+                      SOUP_SESSION_MAX_CONNS,
+                      total,
+                      SOUP_SESSION_MAX_CONNS_PER_HOST,
+                      per_host,
+                      NULL);
+    }
 }
 
-/* step 4: we're done sending the response to libnss_tls */
+/* we open more connections as soon as queries start to queue up */
 static
 void
-on_sent (GObject         *source_object,
-         GAsyncResult    *res,
-         gpointer        user_data)
+grow_pool (struct nss_tls_resolver *resolver)
 {
-    struct nss_tls_session *session = (struct nss_tls_session *)user_data;
-    gsize out;
+    if ((resolver->conns >= max_conns) ||
+        (resolver->inflight <= resolver->conns * get_conn_capacity ())) {
+        return;
+    }
 
-    g_output_stream_write_all_finish (G_OUTPUT_STREAM (source_object),
-                                      res,
-                                      &out,
-                                      NULL);
-    stop_session (session);
+    ++resolver->conns;
+    g_debug ("Using up to %d connections to %s",
+             resolver->conns,
+             resolver->url);
+    apply_pool_sizes ();
 }
 
 static
 void
-on_answer (struct nss_tls_session   *session,
-           const unsigned char      *dns,
-           const gsize              len,
-           ns_msg                   *msg,
-           const int                rr_id,
-           const int                a_type,
-           const size_t             addrlen)
+schedule_dispatch (void);
+
+/*
+ * by Little's law, the number of queries in flight is the query rate times the
+ * latency; we grow the pool to fit that or the peak queue depth, whichever is
+ * bigger, and shrink it by one connection at a time
+ */
+static
+gboolean
+on_pool_resize (gpointer user_data)
 {
-    ns_rr rr;
-    gint64 ttl, now, expiry;
-    int type;
+    struct nss_tls_resolver *resolver;
+    gint64 busy;
+    gint target, prev;
+    guint i;
+    gboolean changed = FALSE;
 
-    if (ns_parserr (msg, ns_s_an, rr_id, &rr) < 0) {
-        g_warning ("Failed to parse a result record for %s",
-                   session->request.name);
-        return;
-    }
+    for (i = 0; i < resolvers->len; ++i) {
+        resolver = g_ptr_array_index (resolvers, i);
 
-    if (ns_rr_class (rr) != ns_c_in)
-        return;
+        busy = (gint64)resolver->queries * resolver->latency /
+               (POOL_RESIZE_INTERVAL * 1000000);
+        busy = MAX (busy, (gint64)resolver->peak);
 
-    type = ns_rr_type (rr);
-    if (type == a_type) {
-        if (ns_rr_rdlen (rr) == addrlen) {
-            memcpy (&session->response.addrs[session->response.count],
-                    ns_rr_rdata (rr),
-                    addrlen);
-            ++session->response.count;
-
-            ttl = (gint64)ns_rr_ttl (rr);
-            if (ttl <= INT64_MAX / 1000000) {
-                if (ttl < MIN_TTL)
-                    ttl = MIN_TTL;
-                ttl *= 1000000;
-                now = g_get_monotonic_time ();
-
-                /*
-                 * after looking at all answer records, we use the shortest
-                 * TTL for all answers
-                 */
-                if (INT64_MAX - ttl >= now) {
-                    expiry = (int64_t)(now + ttl);
-                    if ((session->response.expiry == -1) ||
-                        (expiry < session->response.expiry)) {
-                        session->response.expiry = expiry;
-                    }
-                }
-            }
+        target = (gint)((busy + get_conn_capacity () - 1) / get_conn_capacity ());
+
+        prev = resolver->conns;
+        if (target > resolver->conns) {
+            resolver->conns = target;
+        } else if (target < resolver->conns) {
+            --resolver->conns;
         }
-    }
-    else if (!session->canon &&
-             (type == ns_t_cname) &&
-             !session->response.cname[0] &&
-             (ns_rr_rdlen (rr) > 0)) {
-        if (dn_expand (dns,
-                       dns + len,
-                       ns_rr_rdata (rr),
-                       session->response.cname,
-                       sizeof (session->response.cname)) <= 0) {
-            session->response.cname[0] = '\0';
+        resolver->conns = CLAMP (resolver->conns, min_conns, max_conns);
+
+        if (resolver->conns != prev) {
+            g_debug ("Using up to %d connections to %s",
+                     resolver->conns,
+                     resolver->url);
+            changed = TRUE;
         }
+
+        resolver->queries = 0;
+        resolver->peak = resolver->inflight;
     }
-}
+
+    /* queued lookups may time out while all connections are busy */
+    schedule_dispatch ();
+
+    if (changed) {
+        apply_pool_sizes ();
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static
+void
+start_query (struct nss_tls_session   *session,
+             struct nss_tls_resolver  *resolver)
+{
+    if (session->resolver) {
+        unref_resolver (session->resolver);
+    }
+    session->resolver = ref_resolver (resolver);
+    session->sent = g_get_monotonic_time ();
+    session->inflight = TRUE;
+
+    ++inflight;
+    ++resolver->queries;
+    ++resolver->inflight;
+    resolver->peak = MAX (resolver->peak, resolver->inflight);
+
+    grow_pool (resolver);
+}
+
+static
+void
+finish_query (struct nss_tls_session *session, const gboolean ok)
+{
+    struct nss_tls_resolver *resolver = session->resolver;
+    gint64 latency, method_latency;
+
+    if (!session->inflight) {
+        return;
+    }
+
+    session->inflight = FALSE;
+    --inflight;
+    schedule_dispatch ();
+
+    latency = g_get_monotonic_time () - session->sent;
+
+    NSS_TLS_PROBE (upstream_receive,
+                   session->request.name,
+                   session->request.af,
+                   ok,
+                   latency);
+
+    if (resolver->inflight > 0) {
+        --resolver->inflight;
+    }
+
+    /*
+     * a failed query counts as a timeout, so +auto stops using a method the
+     * server rejects
+     */
+    method_latency = ok ? latency : NSS_TLS_TIMEOUT * G_USEC_PER_SEC;
+    if (resolver->method_latency[session->method] == 0) {
+        resolver->method_latency[session->method] = method_latency;
+    } else {
+        resolver->method_latency[session->method] =
+            (resolver->method_latency[session->method] * 7 +
+             method_latency) / 8;
+    }
+
+    if (!ok) {
+        return;
+    }
+    if (resolver->latency == 0) {
+        resolver->latency = latency;
+    } else {
+        resolver->latency = (resolver->latency * 7 + latency) / 8;
+    }
+}
+
+/*
+ * with +auto, we use the method with the lowest latency, but we try other
+ * methods occasionally, in case they become faster (epsilon-greedy)
+ */
+static
+gint
+choose_auto_method (const struct nss_tls_resolver *resolver)
+{
+    gint method, best = NSS_TLS_METHOD_MIN;
+
+    if (g_random_double () < AUTO_METHOD_EXPLORE) {
+        return g_random_int_range (NSS_TLS_METHOD_MIN, NSS_TLS_METHOD_MAX);
+    }
+
+    for (method = NSS_TLS_METHOD_MIN; method < NSS_TLS_METHOD_MAX; ++method) {
+        /* we try each method at least once */
+        if (resolver->method_latency[method] == 0) {
+            return method;
+        }
+
+        if (resolver->method_latency[method] <
+            resolver->method_latency[best]) {
+            best = method;
+        }
+    }
+
+    return best;
+}
+
+static
+gboolean
+take_token (struct nss_tls_resolver *resolver, const gint64 now)
+{
+    if (resolver->blocked > now) {
+        return FALSE;
+    }
+
+    if (qps == 0) {
+        return TRUE;
+    }
+
+    resolver->tokens += (gdouble)(now - resolver->refilled) * qps / 1000000;
+    resolver->refilled = now;
+    if (resolver->tokens > burst) {
+        resolver->tokens = burst;
+    }
+
+    if (resolver->tokens < 1) {
+        ++resolver->throttled;
+        return FALSE;
+    }
+
+    resolver->tokens -= 1;
+    return TRUE;
+}
+
+/*
+ * if the resolver chosen for a name is rate limited, we shift its share of
+ * queries to the next one; returns NULL if all resolvers are rate limited
+ */
+static
+struct nss_tls_resolver *
+choose_resolver (const gchar *name)
+{
+    struct nss_tls_resolver *resolver;
+    gint64 now;
+    guint id = 0, i;
+
+    if (randomize) {
+        id = (guint)g_random_int_range (0, (gint32)resolvers->len);
+    } else {
+        id = nss_tls_hash_resolver (name, resolvers->len);
+    }
+
+    now = g_get_monotonic_time ();
+
+    for (i = 0; i < resolvers->len; ++i) {
+        resolver = g_ptr_array_index (resolvers, (id + i) % resolvers->len);
+        if (take_token (resolver, now)) {
+            if (i > 0) {
+                g_debug ("%s is rate limited, using %s",
+                         ((struct nss_tls_resolver *)
+                          g_ptr_array_index (resolvers, id))->url,
+                         resolver->url);
+            }
+            return resolver;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * returns the time until any resolver can accept a query or the oldest
+ * throttled query times out, in milliseconds
+ */
+static
+guint
+get_throttle_delay (void)
+{
+    struct nss_tls_resolver *resolver;
+    struct nss_tls_session *session;
+    GList *l;
+    gint64 now, delay, min = G_MAXINT64;
+    guint i;
+
+    now = g_get_monotonic_time ();
+
+    for (i = 0; i < resolvers->len; ++i) {
+        resolver = g_ptr_array_index (resolvers, i);
+        if (resolver->blocked > now) {
+            delay = resolver->blocked - now;
+        } else if (qps > 0) {
+            delay = (gint64)((1 - resolver->tokens) * 1000000 / qps);
+        } else {
+            delay = 0;
+        }
+
+        min = MIN (min, delay);
+    }
+
+    for (l = throttled.head; l; l = l->next) {
+        session = (struct nss_tls_session *)l->data;
+        min = MIN (min, session->sent + NSS_TLS_TIMEOUT * 1000000 - now);
+    }
+
+    return (guint)CLAMP (min / 1000 + 1, 1, MAX_RETRY_AFTER * 1000);
+}
+
+static
+gboolean
+send_query (struct nss_tls_session  *session,
+            unsigned char           *buf,
+            const int               len);
+
+static
+void
+stop_session (struct nss_tls_session *session);
+
+static
+gboolean
+on_throttle_timeout (gpointer user_data)
+{
+    struct nss_tls_session *session;
+    gint64 now;
+    guint count;
+
+    throttle_timer = 0;
+    now = g_get_monotonic_time ();
+
+    /* queries that are throttled again go back to the end of the queue */
+    for (count = throttled.length; count > 0; --count) {
+        session = g_queue_pop_head (&throttled);
+
+        if (now - session->sent >= NSS_TLS_TIMEOUT * 1000000) {
+            g_warning ("Timed out waiting to query %s", session->request.name);
+            stop_session (session);
+        } else if (!send_query (session, session->dns, (int)session->qlen)) {
+            stop_session (session);
+        }
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+static
+void
+throttle_query (struct nss_tls_session *session)
+{
+    if (!session->throttled) {
+        session->sent = g_get_monotonic_time ();
+        session->throttled = TRUE;
+    }
+
+    g_queue_push_tail (&throttled, session);
+
+    if (!throttle_timer) {
+        throttle_timer = g_timeout_add (get_throttle_delay (),
+                                        on_throttle_timeout,
+                                        NULL);
+    }
+}
+
+/*
+ * the DoH server asked us to slow down: we stop sending queries to it for the
+ * duration specified by Retry-After, and retry the query once; returns FALSE
+ * if the query failed
+ */
+static
+gboolean
+on_rate_limited (struct nss_tls_session *session, const gint64 retry_after)
+{
+    struct nss_tls_resolver *resolver = session->resolver;
+
+    g_warning ("%s is rate limited for %"G_GINT64_FORMAT" seconds",
+               resolver->url,
+               retry_after);
+    resolver->blocked = g_get_monotonic_time () + retry_after * 1000000;
+    ++resolver->limited;
+
+    if (session->retried) {
+        return FALSE;
+    }
+
+    session->retried = TRUE;
+    return send_query (session, session->dns, (int)session->qlen);
+}
+
+/* Retry-After is either a number of seconds or a date */
+static
+gint64
+parse_retry_after (const gchar *value)
+{
+    SoupDate *date;
+    gchar *end;
+    gint64 seconds;
+
+    if (!value) {
+        return DEFAULT_RETRY_AFTER;
+    }
+
+    seconds = g_ascii_strtoll (value, &end, 10);
+    if ((end == value) || *end) {
+        date = soup_date_new_from_string (value);
+        if (!date) {
+            return DEFAULT_RETRY_AFTER;
+        }
+
+        seconds = (gint64)(soup_date_to_time_t (date) - time (NULL));
+        soup_date_free (date);
+    }
+
+    return CLAMP (seconds, 1, MAX_RETRY_AFTER);
+}
+
+static
+gboolean
+send_native (struct nss_tls_session *session,
+             const gchar            *url,
+             const gint             max,
+             const gint             method,
+             const unsigned char    *buf,
+             const int              len);
+
+static
+gboolean
+send_query (struct nss_tls_session  *session,
+            unsigned char           *buf,
+            const int               len)
+{
+    g_autofree gchar *url = NULL, *dns = NULL;
+    struct nss_tls_resolver *resolver;
+    SoupMessageFlags flags;
+    gint method;
+
+    /* we keep the query, in case we need to send it again */
+    if (buf != session->dns) {
+        memcpy (session->dns, buf, (gsize)len);
+        buf = session->dns;
+    }
+    session->qlen = (gsize)len;
+
+    resolver = choose_resolver (session->request.name);
+    if (!resolver) {
+        throttle_query (session);
+        return TRUE;
+    }
+
+    if (resolver->method == NSS_TLS_METHOD_RANDOM) {
+        method = g_random_int_range (NSS_TLS_METHOD_MIN, NSS_TLS_METHOD_MAX);
+    } else if (resolver->method == NSS_TLS_METHOD_AUTO) {
+        method = choose_auto_method (resolver);
+    } else {
+        method = (gint)resolver->method;
+    }
+    session->method = method;
+
+    /*
+     * always use 0 for the transaction ID, to improve the server's cache hit
+     * rate
+     */
+    buf[0] = buf[1] = 0;
+
+    if (resolvers->len > 1) {
+        g_debug ("Resolving %s (%s) using %s",
+                 session->request.name,
+                 (session->request.af == AF_INET) ? "IPv4" : "IPv6",
+                 resolver->url);
+    } else {
+        g_debug ("Resolving %s (%s)",
+                 session->request.name,
+                 (session->request.af == AF_INET) ? "IPv4" : "IPv6");
+    }
+
+    start_query (session, resolver);
+
+    NSS_TLS_PROBE (upstream_send,
+                   session->request.name,
+                   session->request.af,
+                   resolver->url,
+                   method);
+
+    if (client == NSS_TLS_CLIENT_NATIVE) {
+        return send_native (session,
+                            resolver->url,
+                            resolver->conns,
+                            method,
+                            buf,
+                            len);
+    }
+
+    if (method == NSS_TLS_METHOD_POST) {
+        session->message = soup_message_new ("POST", resolver->url);
+    } else {
+        dns = nss_tls_encode_query (buf, (gsize)len);
+        url = g_strdup_printf ("%s?dns=%s", resolver->url, dns);
+
+        session->message = soup_message_new ("GET", url);
+    }
+
+    flags = soup_message_get_flags (session->message);
+    soup_message_set_flags (session->message, flags | SOUP_MESSAGE_IDEMPOTENT);
+
+    if (method == NSS_TLS_METHOD_POST) {
+        soup_message_set_request (session->message,
+                                  "application/dns-message",
+                                  SOUP_MEMORY_COPY,
+                                  (const char *)buf,
+                                  (gsize)len);
+    }
+
+    soup_message_headers_append (session->message->request_headers,
+                                 "Accept",
+                                 "application/dns-message");
+
+    soup_session_send_async (soup,
+                             session->message,
+                             NULL,
+                             on_response,
+                             session);
+
+    return TRUE;
+}
+
+/*
+ * interactive lookups may use all connections, while bulk and background
+ * lookups leave some spare capacity for interactive ones; the share of each
+ * priority class is in quarters
+ *
+ * the capacity follows the current pool sizes, plus one connection for each
+ * pool that may still grow, so grow_pool() sees queries queue up
+ */
+static
+gboolean
+can_send (const guint8 prio)
+{
+    static const guint shares[NSS_TLS_PRIO_MAX] = {4, 3, 2};
+    struct nss_tls_resolver *resolver;
+    guint capacity = 0, i;
+
+    for (i = 0; i < resolvers->len; ++i) {
+        resolver = g_ptr_array_index (resolvers, i);
+        capacity += (guint)resolver->conns;
+        if (resolver->conns < max_conns) {
+            ++capacity;
+        }
+    }
+
+    capacity *= get_conn_capacity ();
+    return inflight < MAX (capacity * shares[prio] / 4, 1);
+}
+
+static
+gboolean
+on_dispatch (gpointer user_data)
+{
+    struct nss_tls_session *session;
+    gint64 now;
+    guint8 prio;
+
+    dispatch_source = 0;
+    now = g_get_monotonic_time ();
+
+    for (prio = 0; prio < NSS_TLS_PRIO_MAX; ++prio) {
+        while ((session = g_queue_peek_head (&queued[prio]))) {
+            if (now - session->sent >= NSS_TLS_TIMEOUT * 1000000) {
+                g_queue_pop_head (&queued[prio]);
+                g_warning ("Timed out waiting to query %s",
+                           session->request.name);
+                stop_session (session);
+                continue;
+            }
+
+            /*
+             * lower priority lookups wait while a higher priority one is
+             * queued
+             */
+            if (!can_send (prio)) {
+                return G_SOURCE_REMOVE;
+            }
+
+            g_queue_pop_head (&queued[prio]);
+            if (!send_query (session, session->dns, (int)session->qlen)) {
+                stop_session (session);
+            }
+        }
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+static
+void
+schedule_dispatch (void)
+{
+    guint8 prio;
+
+    if (dispatch_source) {
+        return;
+    }
+
+    for (prio = 0; prio < NSS_TLS_PRIO_MAX; ++prio) {
+        if (queued[prio].length > 0) {
+            dispatch_source = g_idle_add (on_dispatch, NULL);
+            return;
+        }
+    }
+}
+
+/*
+ * queries are sent in the order of their priority class, once their class has
+ * spare connections
+ */
+static
+gboolean
+schedule_query (struct nss_tls_session  *session,
+                unsigned char           *buf,
+                const int               len)
+{
+    guint8 prio = session->request.prio;
+
+    if (prio >= NSS_TLS_PRIO_MAX) {
+        prio = session->request.prio = NSS_TLS_PRIO_INTERACTIVE;
+    }
+
+    if (can_send (prio)) {
+        for (prio = 0; prio < session->request.prio; ++prio) {
+            if (queued[prio].length > 0) {
+                break;
+            }
+        }
+
+        if (prio == session->request.prio) {
+            return send_query (session, buf, len);
+        }
+    }
+
+    memcpy (session->dns, buf, (gsize)len);
+    session->qlen = (gsize)len;
+    session->sent = g_get_monotonic_time ();
+
+    g_queue_push_tail (&queued[session->request.prio], session);
+    schedule_dispatch ();
+
+    return TRUE;
+}
+
+static
+gboolean
+resolve_domain (struct nss_tls_session *session)
+{
+    static unsigned char buf[MAX_REQ_SIZE];
+    int type, len;
+
+    if (get_cached_response (session)) {
+        send_response (session);
+        return TRUE;
+    }
+
+    len = nss_tls_make_query (session->request.name,
+                              session->request.af,
+                              buf,
+                              sizeof (buf),
+                              &type);
+    if (len < 0) {
+        return FALSE;
+    }
+
+    session->response.cname[0] = '\0';
+    session->type = (gint64)type;
+
+    return schedule_query (session, buf, len);
+}
+
+static
+void
+resolve_cname (struct nss_tls_session *session)
+{
+    g_debug ("The canonical name of %s is %s",
+             session->request.name,
+             session->response.cname);
+
+    /* we log the name the client asked for */
+    if (query_log && !session->origin[0]) {
+        strcpy (session->origin, session->request.name);
+    }
+    strcpy (session->request.name, session->response.cname);
+    nss_tls_normalize_name (session->request.name, &session->hash);
+
+    /*
+     * ignore CNAME records for this name; we don't want to be stuck in an
+     * infinite loop if the canonical form of A is B, while B has a CNAME record
+     * that points back to A
+     */
+    session->canon = TRUE;
+
+    resolve_domain (session);
+}
+
+static
+void
+stop_session (struct nss_tls_session *session)
+{
+    log_query (session, FALSE);
+
+    if (session->stub) {
+        stub_reply (session, ns_r_servfail);
+        return;
+    }
+
+    if (session->preload) {
+        free_session (session);
+        return;
+    }
+
+    close_client (session);
+}
+
+/* we received the DNS response, parse it and send our response */
+static
+void
+on_dns_response (struct nss_tls_session *session, const gsize len)
+{
+    if (len == 0) {
+        goto cleanup;
+    }
+
+    /* queries forwarded as-is are answered as-is */
+    if (session->request.af == AF_UNSPEC) {
+        session->stub->alen = len;
+        send_response (session);
+        return;
+    }
+
+    if (!nss_tls_parse_response (session->request.name,
+                                 session->dns,
+                                 len,
+                                 session->request.af,
+                                 session->canon,
+                                 &session->response,
+                                 &session->ttl,
+                                 g_get_monotonic_time ())) {
+        goto cleanup;
+    }
+
+    NSS_TLS_PROBE (parse,
+                   session->request.name,
+                   session->request.af,
+                   session->response.count,
+                   len);
+
+    /* a response that ends a chain of canonical names decides the RCODE */
+    session->nxdomain =
+        (((const HEADER *)session->dns)->rcode == ns_r_nxdomain);
+
+    /* we want to cache addresses or the lack of any addresses */
+    add_to_cache (session);
+
+    if (session->response.cname[0] && (session->response.count == 0)) {
+        resolve_cname (session);
+        return;
+    }
+
+    g_debug ("Done resolving %s with %hhu %s result(s)",
+             session->request.name,
+             session->response.count,
+             (session->request.af == AF_INET) ? "IPv4" : "IPv6");
+
+    send_response (session);
+    return;
+
+cleanup:
+    if (session->response.count == 0) {
+        stop_session (session);
+    }
+}
+
+static
+void
+on_body (GObject         *source_object,
+         GAsyncResult    *res,
+         gpointer        user_data)
+{
+    g_autoptr(GError) err = NULL;
+    struct nss_tls_session *session = (struct nss_tls_session *)user_data;
+    gssize len;
+
+    len = g_input_stream_read_finish (G_INPUT_STREAM (source_object),
+                                      res,
+                                      &err);
+    if (len < 0) {
+        len = 0;
+    }
+
+    on_dns_response (session, len);
+}
+
+/* step 3: we received the HTTPS response, parse it to construct our response
+ * and send it to libnss_tls */
+static
+void
+on_response (GObject         *source_object,
+             GAsyncResult    *res,
+             gpointer        user_data)
+{
+    g_autoptr(GError) err = NULL;
+    struct nss_tls_session *session = (struct nss_tls_session *)user_data;
+    g_autoptr(GInputStream) in = NULL;
+    const char *type;
+    gint64 retry_after;
+
+    in = soup_session_send_finish (SOUP_SESSION (source_object),
+                                   res,
+                                   &err);
+    finish_query (session,
+                  in && SOUP_STATUS_IS_SUCCESSFUL (session->message->status_code));
+    if (!in) {
+        if (err) {
+            g_warning ("Failed to query %s: %s",
+                       session->request.name,
+                       err->message);
+        }
+        else {
+            g_warning ("Failed to query %s", session->request.name);
+        }
+        goto cleanup;
+    }
+
+    if (session->message->status_code == HTTP_TOO_MANY_REQUESTS) {
+        retry_after = parse_retry_after (
+            soup_message_headers_get_one (session->message->response_headers,
+                                          "Retry-After")
+        );
+        g_object_unref (session->message);
+
+        if (!on_rate_limited (session, retry_after) &&
+            (session->response.count == 0)) {
+            stop_session (session);
+        }
+        return;
+    }
+
+    if (!SOUP_STATUS_IS_SUCCESSFUL (session->message->status_code)) {
+        g_warning ("Failed to query %s: HTTP %d",
+                   session->request.name,
+                   session->message->status_code);
+        goto cleanup;
+    }
+
+    type = soup_message_headers_get_content_type (
+        session->message->response_headers,
+        NULL
+    );
+    if (type && strcmp (type, "application/dns-message")) {
+        g_warning ("Bad response type for %s: %s",
+                   session->request.name,
+                   type);
+        goto cleanup;
+    }
+
+    g_input_stream_read_all_async (in,
+                                   session->dns,
+                                   sizeof (session->dns),
+                                   G_PRIORITY_DEFAULT,
+                                   NULL,
+                                   on_body,
+                                   session);
+
+    g_object_unref (session->message);
+
+    return;
+
+cleanup:
+    g_object_unref (session->message);
+
+    if (session->response.count == 0) {
+        stop_session (session);
+    }
+}
+
+/*
+ * the native DoH client keeps persistent connections to each DoH server and
+ * pipelines requests: responses arrive in the order of requests, so each
+ * connection holds a queue of sessions waiting for a response
+ */
+struct nss_tls_conn {
+    gint refs;
+    GList link;
+    gchar *url;
+    gchar *post_head;
+    gchar *get_head;
+    gchar *get_tail;
+    GCancellable *cancellable;
+    GIOStream *stream;
+    GQueue sent;
+    GString *out;
+    GString *pending;
+    gboolean writing;
+    gboolean closing;
+    gint64 last_used;
+    gsize inlen;
+    unsigned char in[HTTP_MAX_HEAD + UINT16_MAX];
+};
+
+static GQueue conns = G_QUEUE_INIT;
+
+static
+struct nss_tls_conn *
+ref_conn (struct nss_tls_conn *conn)
+{
+    ++conn->refs;
+    return conn;
+}
+
+static
+void
+unref_conn (struct nss_tls_conn *conn)
+{
+    if (--conn->refs > 0) {
+        return;
+    }
+
+    if (conn->stream) {
+        g_object_unref (conn->stream);
+    }
+    g_object_unref (conn->cancellable);
+    g_string_free (conn->pending, TRUE);
+    g_string_free (conn->out, TRUE);
+    g_free (conn->get_tail);
+    g_free (conn->get_head);
+    g_free (conn->post_head);
+    g_free (conn->url);
+    g_free (conn);
+}
+
+/* the connection is unusable, so we retry all queries sent over it once */
+static
+void
+stop_conn (struct nss_tls_conn *conn)
+{
+    struct nss_tls_session *session;
+
+    if (!conn->link.data) {
+        return;
+    }
+
+    g_queue_unlink (&conns, &conn->link);
+    conn->link.data = NULL;
+
+    g_cancellable_cancel (conn->cancellable);
+
+    while ((session = g_queue_pop_head (&conn->sent))) {
+        finish_query (session, FALSE);
+
+        if (session->retried) {
+            g_warning ("Failed to query %s", session->request.name);
+            if (session->response.count == 0) {
+                stop_session (session);
+            }
+            continue;
+        }
+
+        session->retried = TRUE;
+        if (!send_query (session, session->dns, (int)session->qlen)) {
+            stop_session (session);
+        }
+    }
+
+    unref_conn (conn);
+}
+
+static
+void
+flush_conn (struct nss_tls_conn *conn);
+
+static
+void
+on_conn_written (GObject         *source_object,
+                 GAsyncResult    *res,
+                 gpointer        user_data)
+{
+    struct nss_tls_conn *conn = (struct nss_tls_conn *)user_data;
+    g_autoptr(GError) err = NULL;
+
+    conn->writing = FALSE;
+
+    if (!g_output_stream_write_all_finish (G_OUTPUT_STREAM (source_object),
+                                           res,
+                                           NULL,
+                                           &err)) {
+        if (conn->link.data) {
+            g_debug ("Failed to send a request to %s: %s",
+                     conn->url,
+                     err->message);
+            stop_conn (conn);
+        }
+    } else {
+        g_string_truncate (conn->out, 0);
+        flush_conn (conn);
+    }
+
+    unref_conn (conn);
+}
+
+static
+void
+flush_conn (struct nss_tls_conn *conn)
+{
+    GOutputStream *out;
+    GString *tmp;
+
+    if (!conn->stream ||
+        conn->writing ||
+        !conn->link.data ||
+        (conn->pending->len == 0)) {
+        return;
+    }
+
+    /* we send all requests queued while the previous write was in progress */
+    tmp = conn->out;
+    conn->out = conn->pending;
+    conn->pending = tmp;
+    conn->writing = TRUE;
+
+    out = g_io_stream_get_output_stream (conn->stream);
+    g_output_stream_write_all_async (out,
+                                     conn->out->str,
+                                     conn->out->len,
+                                     G_PRIORITY_DEFAULT,
+                                     conn->cancellable,
+                                     on_conn_written,
+                                     ref_conn (conn));
+}
+
+static
+gboolean
+has_header (const gchar *line, const gsize len, const gchar *name)
+{
+    gsize namelen = strlen (name);
+
+    return ((len > namelen) &&
+            (line[namelen] == ':') &&
+            (g_ascii_strncasecmp (line, name, namelen) == 0));
+}
+
+static
+const gchar *
+get_header_value (const gchar *line, const gchar *end, const gchar *name)
+{
+    line += strlen (name) + 1;
+    while ((line < end) && ((*line == ' ') || (*line == '\t'))) {
+        ++line;
+    }
+
+    return line;
+}
+
+/*
+ * returns the size of the response, 0 if it's incomplete or -1 if it's
+ * malformed; we only look at the status code, Content-Length, Content-Type
+ * and Connection
+ */
+static
+gssize
+parse_http_response (struct nss_tls_conn   *conn,
+                     guint                 *status,
+                     gsize                 *body,
+                     gsize                 *len,
+                     gboolean              *bad_type,
+                     gint64                *retry_after)
+{
+    gchar buf[64];
+    const gchar *head = (const gchar *)conn->in, *line, *end, *value, *eol;
+    gchar *endp;
+    guint64 length = G_MAXUINT64;
+
+    end = g_strstr_len (head, conn->inlen, "\r\n\r\n");
+    if (!end) {
+        return (conn->inlen >= HTTP_MAX_HEAD) ? -1 : 0;
+    }
+
+    if ((end - head < sizeof ("HTTP/1.1 200") - 1) ||
+        (strncmp (head, "HTTP/1.", sizeof ("HTTP/1.") - 1) != 0) ||
+        (head[sizeof ("HTTP/1.1") - 1] != ' ')) {
+        return -1;
+    }
+
+    *status = (guint)g_ascii_strtoull (head + sizeof ("HTTP/1.1"), &endp, 10);
+    *bad_type = FALSE;
+    *retry_after = DEFAULT_RETRY_AFTER;
+
+    for (line = g_strstr_len (head, end + 2 - head, "\r\n") + 2;
+         line < end;
+         line = eol + 2) {
+        eol = g_strstr_len (line, end + 2 - line, "\r\n");
+        if (!eol) {
+            return -1;
+        }
+
+        if (has_header (line, eol - line, "Content-Length")) {
+            value = get_header_value (line, eol, "Content-Length");
+            length = g_ascii_strtoull (value, &endp, 10);
+            if (endp == value) {
+                return -1;
+            }
+        } else if (has_header (line, eol - line, "Content-Type")) {
+            value = get_header_value (line, eol, "Content-Type");
+            if (((eol - value) != sizeof ("application/dns-message") - 1) ||
+                (g_ascii_strncasecmp (value,
+                                      "application/dns-message",
+                                      eol - value) != 0)) {
+                *bad_type = TRUE;
+            }
+        } else if (has_header (line, eol - line, "Connection")) {
+            value = get_header_value (line, eol, "Connection");
+            if (((eol - value) == sizeof ("close") - 1) &&
+                (g_ascii_strncasecmp (value, "close", eol - value) == 0)) {
+                conn->closing = TRUE;
+            }
+        } else if (has_header (line, eol - line, "Retry-After")) {
+            value = get_header_value (line, eol, "Retry-After");
+            if (eol - value < sizeof (buf)) {
+                memcpy (buf, value, eol - value);
+                buf[eol - value] = '\0';
+                *retry_after = parse_retry_after (buf);
+            }
+        } else if (has_header (line, eol - line, "Transfer-Encoding")) {
+            /* we never send HTTP/1.0 requests, so servers can use chunks */
+            return -1;
+        }
+    }
+
+    *body = (gsize)(end + 4 - head);
+
+    if (length > UINT16_MAX) {
+        return -1;
+    }
+
+    *len = (gsize)length;
+
+    if (*body + *len > conn->inlen) {
+        return 0;
+    }
+
+    return (gssize)(*body + *len);
+}
+
+static
+void
+read_conn (struct nss_tls_conn *conn);
+
+static
+void
+on_conn_read (GObject         *source_object,
+              GAsyncResult    *res,
+              gpointer        user_data)
+{
+    struct nss_tls_conn *conn = (struct nss_tls_conn *)user_data;
+    struct nss_tls_session *session;
+    g_autoptr(GError) err = NULL;
+    gssize in, total;
+    gsize body, len;
+    gint64 retry_after;
+    guint status;
+    gboolean bad_type;
+
+    in = g_input_stream_read_finish (G_INPUT_STREAM (source_object),
+                                     res,
+                                     &err);
+    if (!conn->link.data) {
+        goto out;
+    }
+
+    if (in <= 0) {
+        stop_conn (conn);
+        goto out;
+    }
+
+    conn->inlen += (gsize)in;
+
+    while ((total = parse_http_response (conn,
+                                         &status,
+                                         &body,
+                                         &len,
+                                         &bad_type,
+                                         &retry_after)) > 0) {
+        session = g_queue_pop_head (&conn->sent);
+        if (!session) {
+            stop_conn (conn);
+            goto out;
+        }
+
+        finish_query (session, SOUP_STATUS_IS_SUCCESSFUL (status));
+
+        if (status == HTTP_TOO_MANY_REQUESTS) {
+            if (!on_rate_limited (session, retry_after) &&
+                (session->response.count == 0)) {
+                stop_session (session);
+            }
+        } else if (!SOUP_STATUS_IS_SUCCESSFUL (status)) {
+            g_warning ("Failed to query %s: HTTP %u",
+                       session->request.name,
+                       status);
+            if (session->response.count == 0) {
+                stop_session (session);
+            }
+        } else if (bad_type) {
+            g_warning ("Bad response type for %s", session->request.name);
+            if (session->response.count == 0) {
+                stop_session (session);
+            }
+        } else {
+            memcpy (session->dns, conn->in + body, len);
+            on_dns_response (session, len);
+        }
+
+        conn->inlen -= (gsize)total;
+        memmove (conn->in, conn->in + total, conn->inlen);
+        conn->last_used = g_get_monotonic_time ();
+    }
+
+    if ((total < 0) || (conn->closing && (conn->sent.length == 0))) {
+        stop_conn (conn);
+        goto out;
+    }
+
+    read_conn (conn);
+
+out:
+    unref_conn (conn);
+}
+
+static
+void
+read_conn (struct nss_tls_conn *conn)
+{
+    GInputStream *in;
+
+    in = g_io_stream_get_input_stream (conn->stream);
+    g_input_stream_read_async (in,
+                               conn->in + conn->inlen,
+                               sizeof (conn->in) - conn->inlen,
+                               G_PRIORITY_DEFAULT,
+                               conn->cancellable,
+                               on_conn_read,
+                               ref_conn (conn));
+}
+
+static
+void
+on_conn_ready (GObject         *source_object,
+               GAsyncResult    *res,
+               gpointer        user_data)
+{
+    struct nss_tls_conn *conn = (struct nss_tls_conn *)user_data;
+    g_autoptr(GError) err = NULL;
+    GSocketConnection *connection;
+
+    connection = g_socket_client_connect_finish (G_SOCKET_CLIENT (source_object),
+                                                 res,
+                                                 &err);
+    if (!connection) {
+        if (conn->link.data) {
+            g_warning ("Failed to connect to %s: %s", conn->url, err->message);
+            stop_conn (conn);
+        }
+        goto out;
+    }
+
+    conn->stream = G_IO_STREAM (connection);
+
+    /*
+     * the timeout of the GSocketClient applies to reads too, so a connection
+     * waiting for requests would fail once it expires: on_conn_timeout()
+     * closes connections that are idle or wait too long for a response
+     */
+    g_socket_set_timeout (g_socket_connection_get_socket (connection), 0);
+
+    if (conn->link.data) {
+        read_conn (conn);
+        flush_conn (conn);
+    }
+
+out:
+    unref_conn (conn);
+}
+
+static
+struct nss_tls_conn *
+new_conn (const gchar *url)
+{
+    g_autoptr(GSocketConnectable) addr = NULL;
+    g_autoptr(GSocketClient) client = NULL;
+    struct nss_tls_conn *conn;
+    SoupURI *uri;
+    gchar *path;
+
+    uri = soup_uri_new (url);
+    if (!uri) {
+        return NULL;
+    }
+
+    path = soup_uri_to_string (uri, TRUE);
+
+    conn = g_new0 (struct nss_tls_conn, 1);
+    conn->refs = 1;
+    conn->url = g_strdup (url);
+
+    /* we build the constant parts of each request only once */
+    conn->post_head = g_strdup_printf (
+        "POST %s HTTP/1.1\r\n"
+        "Host: %s\r\n"
+        "Accept: application/dns-message\r\n"
+        "Content-Type: application/dns-message\r\n"
+        "Content-Length: ",
+        path,
+        soup_uri_get_host (uri)
+    );
+    conn->get_head = g_strdup_printf ("GET %s%cdns=",
+                                      path,
+                                      soup_uri_get_query (uri) ? '&' : '?');
+    conn->get_tail = g_strdup_printf (
+        " HTTP/1.1\r\n"
+        "Host: %s\r\n"
+        "Accept: application/dns-message\r\n"
+        "\r\n",
+        soup_uri_get_host (uri)
+    );
+
+    conn->cancellable = g_cancellable_new ();
+    conn->out = g_string_sized_new (HTTP_MAX_HEAD);
+    conn->pending = g_string_sized_new (HTTP_MAX_HEAD);
+    conn->last_used = g_get_monotonic_time ();
+
+    client = g_socket_client_new ();
+    g_socket_client_set_timeout (client, NSS_TLS_TIMEOUT);
+    g_socket_client_set_tls (client, uri->scheme == SOUP_URI_SCHEME_HTTPS);
+
+    addr = g_network_address_new (soup_uri_get_host (uri),
+                                  (guint16)soup_uri_get_port (uri));
+    g_socket_client_connect_async (client,
+                                   addr,
+                                   conn->cancellable,
+                                   on_conn_ready,
+                                   ref_conn (conn));
+
+    conn->link.data = conn;
+    g_queue_push_tail_link (&conns, &conn->link);
+
+    g_free (path);
+    soup_uri_free (uri);
+
+    return conn;
+}
+
+/*
+ * we prefer the connection with the shortest queue, unless all connections
+ * are busy and we can open another one
+ */
+static
+struct nss_tls_conn *
+get_conn (const gchar *url, const gint max)
+{
+    struct nss_tls_conn *conn, *best = NULL;
+    GList *l;
+    guint count = 0;
+
+    for (l = conns.head; l; l = l->next) {
+        conn = (struct nss_tls_conn *)l->data;
+        if (conn->closing || strcmp (conn->url, url)) {
+            continue;
+        }
+
+        ++count;
+        if (!best || (conn->sent.length < best->sent.length)) {
+            best = conn;
+        }
+    }
+
+    if (!best ||
+        ((best->sent.length >= HTTP_PIPELINE_DEPTH) && (count < max))) {
+        return new_conn (url);
+    }
+
+    return best;
+}
+
+static
+gboolean
+send_native (struct nss_tls_session *session,
+             const gchar            *url,
+             const gint             max,
+             const gint             method,
+             const unsigned char    *buf,
+             const int              len)
+{
+    g_autofree gchar *dns = NULL;
+    struct nss_tls_conn *conn;
+
+    conn = get_conn (url, max);
+    if (!conn) {
+        return FALSE;
+    }
+
+    if (method == NSS_TLS_METHOD_POST) {
+        g_string_append (conn->pending, conn->post_head);
+        g_string_append_printf (conn->pending, "%d\r\n\r\n", len);
+        g_string_append_len (conn->pending, (const gchar *)buf, len);
+    } else {
+        dns = nss_tls_encode_query (buf, (gsize)len);
+        g_string_append (conn->pending, conn->get_head);
+        g_string_append (conn->pending, dns);
+        g_string_append (conn->pending, conn->get_tail);
+    }
+
+    g_queue_push_tail (&conn->sent, session);
+    conn->last_used = session->sent;
+
+    flush_conn (conn);
+    return TRUE;
+}
+
+static
+guint
+count_conns (const gchar *url)
+{
+    GList *l;
+    guint count = 0;
+
+    for (l = conns.head; l; l = l->next) {
+        if (strcmp (((struct nss_tls_conn *)l->data)->url, url) == 0) {
+            ++count;
+        }
+    }
+
+    return count;
+}
+
+/* returns 0 if the resolver was removed from the configuration */
+static
+guint
+get_pool_size (const gchar *url)
+{
+    struct nss_tls_resolver *resolver;
+    guint i;
+
+    for (i = 0; i < resolvers->len; ++i) {
+        resolver = g_ptr_array_index (resolvers, i);
+        if (strcmp (resolver->url, url) == 0) {
+            return (guint)resolver->conns;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * we close connections that have been idle for NSS_TLS_IDLE_TIMEOUT seconds,
+ * or did not receive a response within NSS_TLS_TIMEOUT seconds; idle
+ * connections beyond the size of the resolver's pool are closed too
+ */
+static
+gboolean
+on_conn_timeout (gpointer user_data)
+{
+    struct nss_tls_conn *conn;
+    struct nss_tls_session *session;
+    GList *l, *next;
+    gint64 now;
+
+    now = g_get_monotonic_time ();
+
+    for (l = conns.head; l; l = next) {
+        next = l->next;
+        conn = (struct nss_tls_conn *)l->data;
+
+        session = g_queue_peek_head (&conn->sent);
+        if (!session) {
+            if ((now - conn->last_used >= NSS_TLS_IDLE_TIMEOUT * 1000000) ||
+                (count_conns (conn->url) > get_pool_size (conn->url))) {
+                stop_conn (conn);
+            }
+        } else if (now - session->sent >= NSS_TLS_TIMEOUT * 1000000) {
+            g_debug ("Timed out waiting for %s", conn->url);
+            stop_conn (conn);
+        }
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/*
+ * nss-tlsd resolves the DoH server names through its own GResolver, which
+ * returns the bootstrap addresses specified in nss-tls.conf or caches the
+ * results of the default GResolver; the addresses are interleaved by family,
+ * so GSocketClient (since GLib 2.60) races IPv6 and IPv4 connections
+ * (RFC 8305)
+ */
+struct nss_tls_host {
+    GList *addrs;
+    gint64 expiry;
+};
+
+#define NSS_TLS_TYPE_RESOLVER (nss_tls_resolver_get_type ())
+G_DECLARE_FINAL_TYPE (NssTlsResolver,
+                      nss_tls_resolver,
+                      NSS_TLS,
+                      RESOLVER,
+                      GResolver)
+
+struct _NssTlsResolver {
+    GResolver parent_instance;
+    GResolver *fallback;
+};
+
+G_DEFINE_TYPE (NssTlsResolver, nss_tls_resolver, G_TYPE_RESOLVER)
+
+G_LOCK_DEFINE_STATIC (hosts);
+static GHashTable *hosts = NULL;
+
+static
+void
+free_host (gpointer data)
+{
+    struct nss_tls_host *host = data;
+
+    g_resolver_free_addresses (host->addrs);
+    g_free (host);
+}
+
+static
+GList *
+copy_addresses (GList *addrs, const GResolverNameLookupFlags flags)
+{
+    GList *l, *copy = NULL;
+    GSocketFamily family;
+
+    for (l = addrs; l; l = l->next) {
+        family = g_inet_address_get_family (l->data);
+        if (((flags == G_RESOLVER_NAME_LOOKUP_FLAGS_IPV4_ONLY) &&
+             (family != G_SOCKET_FAMILY_IPV4)) ||
+            ((flags == G_RESOLVER_NAME_LOOKUP_FLAGS_IPV6_ONLY) &&
+             (family != G_SOCKET_FAMILY_IPV6))) {
+            continue;
+        }
+
+        copy = g_list_prepend (copy, g_object_ref (l->data));
+    }
+
+    return g_list_reverse (copy);
+}
+
+/* we alternate between address families, starting with the preferred one */
+static
+GList *
+interleave_addresses (GList *addrs)
+{
+    GQueue families[2] = {G_QUEUE_INIT, G_QUEUE_INIT};
+    GList *l, *ret = NULL;
+    GSocketFamily first;
+    gint i;
+
+    if (!addrs) {
+        return NULL;
+    }
+
+    first = g_inet_address_get_family (addrs->data);
+    for (l = addrs; l; l = l->next) {
+        i = (g_inet_address_get_family (l->data) == first) ? 0 : 1;
+        g_queue_push_tail (&families[i], l->data);
+    }
+    g_list_free (addrs);
+
+    while (families[0].length || families[1].length) {
+        for (i = 0; i < G_N_ELEMENTS (families); ++i) {
+            if (families[i].length) {
+                ret = g_list_prepend (ret, g_queue_pop_head (&families[i]));
+            }
+        }
+    }
+
+    return g_list_reverse (ret);
+}
+
+/* returns cached addresses, even if expired when stale is TRUE */
+static
+GList *
+get_host_addresses (const gchar                     *name,
+                    const GResolverNameLookupFlags  flags,
+                    const gboolean                  stale)
+{
+    struct nss_tls_host *host;
+    GList *addrs = NULL;
+
+    G_LOCK (hosts);
+
+    host = g_hash_table_lookup (hosts, name);
+    if (host &&
+        (stale ||
+         (host->expiry == -1) ||
+         (host->expiry > g_get_monotonic_time ()))) {
+        addrs = copy_addresses (host->addrs, flags);
+    }
+
+    G_UNLOCK (hosts);
+
+    return addrs;
+}
+
+static
+void
+set_host_addresses (const gchar *name, GList *addrs, const gint64 expiry)
+{
+    struct nss_tls_host *host;
+
+    host = g_new (struct nss_tls_host, 1);
+    host->addrs = interleave_addresses (addrs);
+    host->expiry = expiry;
+
+    G_LOCK (hosts);
+    g_hash_table_replace (hosts, g_strdup (name), host);
+    G_UNLOCK (hosts);
+}
+
+static
+void
+cache_host_addresses (const gchar *name, GList *addrs)
+{
+    struct nss_tls_host *host;
+    gboolean bootstrap;
+
+    /* we never replace bootstrap addresses */
+    G_LOCK (hosts);
+    host = g_hash_table_lookup (hosts, name);
+    bootstrap = host && (host->expiry == -1);
+    G_UNLOCK (hosts);
+
+    if (!bootstrap) {
+        set_host_addresses (name,
+                            copy_addresses (addrs,
+                                            G_RESOLVER_NAME_LOOKUP_FLAGS_DEFAULT),
+                            g_get_monotonic_time () + HOST_CACHE_TTL);
+    }
+}
+
+static
+GList *
+lookup_host (NssTlsResolver                 *resolver,
+             const gchar                    *name,
+             const GResolverNameLookupFlags flags,
+             GCancellable                   *cancellable,
+             GError                         **error)
+{
+    GError *err = NULL;
+    GList *addrs;
+
+    addrs = get_host_addresses (name, flags, FALSE);
+    if (addrs) {
+        return addrs;
+    }
+
+    addrs = g_resolver_lookup_by_name (resolver->fallback,
+                                       name,
+                                       cancellable,
+                                       &err);
+    if (addrs) {
+        cache_host_addresses (name, addrs);
+        g_resolver_free_addresses (addrs);
+    }
+
+    /* if the lookup fails, we use the addresses we had before */
+    addrs = get_host_addresses (name, flags, TRUE);
+    if (addrs) {
+        g_clear_error (&err);
+    } else if (err) {
+        g_propagate_error (error, err);
+    } else {
+        g_set_error (error,
+                     G_RESOLVER_ERROR,
+                     G_RESOLVER_ERROR_NOT_FOUND,
+                     "No addresses for %s",
+                     name);
+    }
+
+    return addrs;
+}
+
+static
+void
+on_host_resolved (GObject       *source_object,
+                  GAsyncResult  *res,
+                  gpointer      user_data)
+{
+    GTask *task = user_data;
+    GError *err = NULL;
+    GList *addrs;
+    const gchar *name = g_task_get_task_data (task);
+    GResolverNameLookupFlags flags;
+
+    flags = (GResolverNameLookupFlags)GPOINTER_TO_INT (
+        g_object_get_data (G_OBJECT (task), "flags")
+    );
+
+    addrs = g_resolver_lookup_by_name_finish (G_RESOLVER (source_object),
+                                              res,
+                                              &err);
+    if (addrs) {
+        cache_host_addresses (name, addrs);
+        g_resolver_free_addresses (addrs);
+    }
+
+    /* if the lookup fails, we use the addresses we had before */
+    addrs = get_host_addresses (name, flags, TRUE);
+    if (addrs) {
+        g_task_return_pointer (task,
+                               addrs,
+                               (GDestroyNotify)g_resolver_free_addresses);
+        g_clear_error (&err);
+    } else if (err) {
+        g_task_return_error (task, err);
+    } else {
+        g_task_return_new_error (task,
+                                 G_RESOLVER_ERROR,
+                                 G_RESOLVER_ERROR_NOT_FOUND,
+                                 "No addresses for %s",
+                                 name);
+    }
+
+    g_object_unref (task);
+}
+
+static
+void
+lookup_host_async (NssTlsResolver                   *resolver,
+                   const gchar                      *name,
+                   const GResolverNameLookupFlags   flags,
+                   GCancellable                     *cancellable,
+                   GAsyncReadyCallback              callback,
+                   gpointer                         user_data)
+{
+    GTask *task;
+    GList *addrs;
+
+    task = g_task_new (resolver, cancellable, callback, user_data);
+
+    addrs = get_host_addresses (name, flags, FALSE);
+    if (addrs) {
+        g_task_return_pointer (task,
+                               addrs,
+                               (GDestroyNotify)g_resolver_free_addresses);
+        g_object_unref (task);
+        return;
+    }
+
+    g_task_set_task_data (task, g_strdup (name), g_free);
+    g_object_set_data (G_OBJECT (task), "flags", GINT_TO_POINTER (flags));
+
+    g_resolver_lookup_by_name_async (resolver->fallback,
+                                     name,
+                                     cancellable,
+                                     on_host_resolved,
+                                     task);
+}
+
+static
+GList *
+nss_tls_resolver_lookup_by_name (GResolver      *resolver,
+                                 const gchar    *hostname,
+                                 GCancellable   *cancellable,
+                                 GError         **error)
+{
+    return lookup_host (NSS_TLS_RESOLVER (resolver),
+                        hostname,
+                        G_RESOLVER_NAME_LOOKUP_FLAGS_DEFAULT,
+                        cancellable,
+                        error);
+}
+
+static
+void
+nss_tls_resolver_lookup_by_name_async (GResolver            *resolver,
+                                       const gchar          *hostname,
+                                       GCancellable         *cancellable,
+                                       GAsyncReadyCallback  callback,
+                                       gpointer             user_data)
+{
+    lookup_host_async (NSS_TLS_RESOLVER (resolver),
+                       hostname,
+                       G_RESOLVER_NAME_LOOKUP_FLAGS_DEFAULT,
+                       cancellable,
+                       callback,
+                       user_data);
+}
+
+static
+GList *
+nss_tls_resolver_lookup_by_name_finish (GResolver       *resolver,
+                                        GAsyncResult    *result,
+                                        GError          **error)
+{
+    return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+#if GLIB_CHECK_VERSION (2, 60, 0)
+
+static
+GList *
+nss_tls_resolver_lookup_by_name_with_flags (GResolver                   *resolver,
+                                            const gchar                 *hostname,
+                                            GResolverNameLookupFlags    flags,
+                                            GCancellable                *cancellable,
+                                            GError                      **error)
+{
+    return lookup_host (NSS_TLS_RESOLVER (resolver),
+                        hostname,
+                        flags,
+                        cancellable,
+                        error);
+}
+
+static
+void
+nss_tls_resolver_lookup_by_name_with_flags_async (GResolver                 *resolver,
+                                                  const gchar               *hostname,
+                                                  GResolverNameLookupFlags  flags,
+                                                  GCancellable              *cancellable,
+                                                  GAsyncReadyCallback       callback,
+                                                  gpointer                  user_data)
+{
+    lookup_host_async (NSS_TLS_RESOLVER (resolver),
+                       hostname,
+                       flags,
+                       cancellable,
+                       callback,
+                       user_data);
+}
+
+#endif
+
+/* reverse lookups and records are passed to the default GResolver */
+static
+gchar *
+nss_tls_resolver_lookup_by_address (GResolver       *resolver,
+                                    GInetAddress    *address,
+                                    GCancellable    *cancellable,
+                                    GError          **error)
+{
+    return g_resolver_lookup_by_address (NSS_TLS_RESOLVER (resolver)->fallback,
+                                         address,
+                                         cancellable,
+                                         error);
+}
+
+static
+void
+on_address_resolved (GObject        *source_object,
+                     GAsyncResult   *res,
+                     gpointer       user_data)
+{
+    GTask *task = user_data;
+    GError *err = NULL;
+    gchar *name;
+
+    name = g_resolver_lookup_by_address_finish (G_RESOLVER (source_object),
+                                                res,
+                                                &err);
+    if (name) {
+        g_task_return_pointer (task, name, g_free);
+    } else {
+        g_task_return_error (task, err);
+    }
+
+    g_object_unref (task);
+}
+
+static
+void
+nss_tls_resolver_lookup_by_address_async (GResolver             *resolver,
+                                          GInetAddress          *address,
+                                          GCancellable          *cancellable,
+                                          GAsyncReadyCallback   callback,
+                                          gpointer              user_data)
+{
+    g_resolver_lookup_by_address_async (NSS_TLS_RESOLVER (resolver)->fallback,
+                                        address,
+                                        cancellable,
+                                        on_address_resolved,
+                                        g_task_new (resolver,
+                                                    cancellable,
+                                                    callback,
+                                                    user_data));
+}
+
+static
+gchar *
+nss_tls_resolver_lookup_by_address_finish (GResolver    *resolver,
+                                           GAsyncResult *result,
+                                           GError       **error)
+{
+    return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static
+GList *
+nss_tls_resolver_lookup_records (GResolver              *resolver,
+                                 const gchar            *rrname,
+                                 GResolverRecordType    record_type,
+                                 GCancellable           *cancellable,
+                                 GError                 **error)
+{
+    return g_resolver_lookup_records (NSS_TLS_RESOLVER (resolver)->fallback,
+                                      rrname,
+                                      record_type,
+                                      cancellable,
+                                      error);
+}
+
+static
+void
+free_records (gpointer data)
+{
+    g_list_free_full (data, (GDestroyNotify)g_variant_unref);
+}
+
+static
+void
+on_records_resolved (GObject        *source_object,
+                     GAsyncResult   *res,
+                     gpointer       user_data)
+{
+    GTask *task = user_data;
+    GError *err = NULL;
+    GList *records;
+
+    records = g_resolver_lookup_records_finish (G_RESOLVER (source_object),
+                                                res,
+                                                &err);
+    if (err) {
+        g_task_return_error (task, err);
+    } else {
+        g_task_return_pointer (task, records, free_records);
+    }
+
+    g_object_unref (task);
+}
+
+static
+void
+nss_tls_resolver_lookup_records_async (GResolver            *resolver,
+                                       const gchar          *rrname,
+                                       GResolverRecordType  record_type,
+                                       GCancellable         *cancellable,
+                                       GAsyncReadyCallback  callback,
+                                       gpointer             user_data)
+{
+    g_resolver_lookup_records_async (NSS_TLS_RESOLVER (resolver)->fallback,
+                                     rrname,
+                                     record_type,
+                                     cancellable,
+                                     on_records_resolved,
+                                     g_task_new (resolver,
+                                                 cancellable,
+                                                 callback,
+                                                 user_data));
+}
+
+static
+GList *
+nss_tls_resolver_lookup_records_finish (GResolver       *resolver,
+                                        GAsyncResult    *result,
+                                        GError          **error)
+{
+    return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static
+void
+nss_tls_resolver_finalize (GObject *object)
+{
+    g_object_unref (NSS_TLS_RESOLVER (object)->fallback);
+
+    G_OBJECT_CLASS (nss_tls_resolver_parent_class)->finalize (object);
+}
+
+static
+void
+nss_tls_resolver_class_init (NssTlsResolverClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+    GResolverClass *resolver_class = G_RESOLVER_CLASS (klass);
+
+    object_class->finalize = nss_tls_resolver_finalize;
+
+    resolver_class->lookup_by_name = nss_tls_resolver_lookup_by_name;
+    resolver_class->lookup_by_name_async =
+        nss_tls_resolver_lookup_by_name_async;
+    resolver_class->lookup_by_name_finish =
+        nss_tls_resolver_lookup_by_name_finish;
+#if GLIB_CHECK_VERSION (2, 60, 0)
+    resolver_class->lookup_by_name_with_flags =
+        nss_tls_resolver_lookup_by_name_with_flags;
+    resolver_class->lookup_by_name_with_flags_async =
+        nss_tls_resolver_lookup_by_name_with_flags_async;
+    resolver_class->lookup_by_name_with_flags_finish =
+        nss_tls_resolver_lookup_by_name_finish;
+#endif
+    resolver_class->lookup_by_address = nss_tls_resolver_lookup_by_address;
+    resolver_class->lookup_by_address_async =
+        nss_tls_resolver_lookup_by_address_async;
+    resolver_class->lookup_by_address_finish =
+        nss_tls_resolver_lookup_by_address_finish;
+    resolver_class->lookup_records = nss_tls_resolver_lookup_records;
+    resolver_class->lookup_records_async =
+        nss_tls_resolver_lookup_records_async;
+    resolver_class->lookup_records_finish =
+        nss_tls_resolver_lookup_records_finish;
+}
+
+static
+void
+nss_tls_resolver_init (NssTlsResolver *resolver)
+{
+    resolver->fallback = g_resolver_get_default ();
+}
+
+static
+gboolean
+is_resolved_host (gpointer key,
+                  gpointer value,
+                  gpointer user_data)
+{
+    return ((struct nss_tls_host *)value)->expiry != -1;
+}
+
+/* we keep bootstrap addresses, but forget addresses we resolved */
+static
+void
+forget_host_addresses (void)
+{
+    G_LOCK (hosts);
+    g_hash_table_foreach_remove (hosts, is_resolved_host, NULL);
+    G_UNLOCK (hosts);
+}
+
+/* bootstrap addresses never expire */
+static
+void
+set_bootstrap_addresses (GKeyFile *cfg)
+{
+    g_auto(GStrv) names = NULL;
+    gchar **list, **name, **p;
+    GInetAddress *addr;
+    GList *addrs;
+
+    G_LOCK (hosts);
+    g_hash_table_remove_all (hosts);
+    G_UNLOCK (hosts);
+
+    names = g_key_file_get_keys (cfg, "bootstrap", NULL, NULL);
+    if (!names) {
+        return;
+    }
+
+    for (name = names; *name; ++name) {
+        list = g_key_file_get_string_list (cfg,
+                                           "bootstrap",
+                                           *name,
+                                           NULL,
+                                           NULL);
+        if (!list) {
+            continue;
+        }
+
+        addrs = NULL;
+        for (p = list; *p; ++p) {
+            addr = g_inet_address_new_from_string (g_strstrip (*p));
+            if (addr) {
+                addrs = g_list_prepend (addrs, addr);
+            } else {
+                g_warning ("Bad bootstrap address for %s: %s", *name, *p);
+            }
+        }
+
+        if (addrs) {
+            set_host_addresses (*name, g_list_reverse (addrs), -1);
+        }
+
+        g_strfreev (list);
+    }
+}
+
+/*
+ * with -l, nss-tlsd may be the DNS server in resolv.conf, and it refuses
+ * queries for the DoH server names, so it cannot resolve them through DNS
+ */
+static
+void
+check_bootstrap_addresses (void)
+{
+    struct nss_tls_resolver *resolver;
+    struct nss_tls_host *host;
+    gboolean bootstrap;
+    guint i;
+
+    if (!listen_addr) {
+        return;
+    }
+
+    for (i = 0; i < resolvers->len; ++i) {
+        resolver = g_ptr_array_index (resolvers, i);
+        if (g_hostname_is_ip_address (resolver->domain)) {
+            continue;
+        }
+
+        G_LOCK (hosts);
+        host = g_hash_table_lookup (hosts, resolver->domain);
+        bootstrap = host && (host->expiry == -1);
+        G_UNLOCK (hosts);
+
+        if (!bootstrap) {
+            g_warning ("%s has no bootstrap addresses: unless it is in "
+                       "/etc/hosts, it cannot be resolved if nss-tlsd is the "
+                       "DNS server",
+                       resolver->domain);
+        }
+    }
+}
+
+/*
+ * the DoH server addresses must be resolved by other means, otherwise this
+ * results in infinite recursion
+ */
+static
+gboolean
+is_server_domain (const gchar *name)
+{
+    guint i;
+
+    for (i = 0; i < resolvers->len; ++i) {
+        if (strcmp (name,
+                    ((struct nss_tls_resolver *)
+                     g_ptr_array_index (resolvers, i))->domain) == 0) {
+            g_debug ("%s is a DoH server domain", name);
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static
+void
+add_to_filter (const guint8 type, const gchar *name)
+{
+    gchar *p;
+    guint64 hash;
+    gsize len;
+    guint8 i;
+
+    if (filter->count == NSS_TLS_FILTER_MAX) {
+        return;
+    }
+
+    i = filter->count;
+    filter->names[i].type = type;
+    g_strlcpy (filter->names[i].name, name, sizeof (filter->names[i].name));
+
+    /* names are lowercased and have no trailing dot, like requests */
+    for (p = filter->names[i].name; *p; ++p) {
+        *p = g_ascii_tolower (*p);
+    }
+    len = p - filter->names[i].name;
+    if ((len > 0) && (filter->names[i].name[len - 1] == '.')) {
+        filter->names[i].name[--len] = '\0';
+    }
+    if (len == 0) {
+        return;
+    }
+
+    hash = nss_tls_filter_hash (type, filter->names[i].name, len);
+    filter->bloom[nss_tls_filter_bit (hash, 0) / 8] |=
+        1 << (nss_tls_filter_bit (hash, 0) % 8);
+    filter->bloom[nss_tls_filter_bit (hash, 1) / 8] |=
+        1 << (nss_tls_filter_bit (hash, 1) % 8);
+
+    ++filter->count;
+}
+
+/* we publish the same rules as nss_tls_is_suffixed() and is_server_domain() */
+static
+void
+publish_filter (void)
+{
+    struct __res_state res;
+    guint i;
+
+    if (!filter) {
+        return;
+    }
+
+    __atomic_add_fetch (&filter->generation, 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+
+    memset (filter->bloom, 0, sizeof (filter->bloom));
+    filter->count = 0;
+
+    if (res_ninit (&res) == 0) {
+        for (i = 0; (i < G_N_ELEMENTS (res.dnsrch)) && res.dnsrch[i]; ++i) {
+            add_to_filter (NSS_TLS_FILTER_SUFFIX, res.dnsrch[i]);
+        }
+
+        res_nclose (&res);
+    }
+
+    for (i = 0; i < resolvers->len; ++i) {
+        add_to_filter (NSS_TLS_FILTER_SERVER,
+                       ((struct nss_tls_resolver *)
+                        g_ptr_array_index (resolvers, i))->domain);
+    }
+
+    __atomic_add_fetch (&filter->generation, 1, __ATOMIC_RELEASE);
+}
+
+static
+gboolean
+on_heartbeat (gpointer user_data)
+{
+    __atomic_store_n (&filter->heartbeat,
+                      g_get_monotonic_time (),
+                      __ATOMIC_RELAXED);
+    return G_SOURCE_CONTINUE;
+}
+
+static
+void
+on_resolv_changed (GFileMonitor        *monitor,
+                   GFile                *file,
+                   GFile                *other_file,
+                   GFileMonitorEvent    event_type,
+                   gpointer            user_data)
+{
+    if (event_type == G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT) {
+        publish_filter ();
+    }
+}
+
+/*
+ * the file is updated in place, so libnss_tls can keep it mapped, even if
+ * nss-tlsd restarts
+ */
+static
+void
+open_filter (const gchar *path)
+{
+    g_autoptr(GFile) resolv = NULL;
+    int fd;
+
+    fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        g_warning ("Failed to open %s: %s", path, g_strerror (errno));
+        return;
+    }
+
+    if (ftruncate (fd, sizeof (*filter)) < 0) {
+        g_warning ("Failed to resize %s: %s", path, g_strerror (errno));
+        close (fd);
+        return;
+    }
+
+    filter = mmap (NULL,
+                   sizeof (*filter),
+                   PROT_READ | PROT_WRITE,
+                   MAP_SHARED,
+                   fd,
+                   0);
+    close (fd);
+    if (filter == MAP_FAILED) {
+        g_warning ("Failed to map %s: %s", path, g_strerror (errno));
+        filter = NULL;
+        return;
+    }
+
+    filter->magic = NSS_TLS_FILTER_MAGIC;
+    publish_filter ();
+
+    /* the heartbeat stops if the main loop is stuck */
+    on_heartbeat (NULL);
+    g_timeout_add_seconds (NSS_TLS_HEARTBEAT_INTERVAL, on_heartbeat, NULL);
+
+    resolv = g_file_new_for_path (_PATH_RESCONF);
+    resolv_monitor = g_file_monitor_file (resolv,
+                                          G_FILE_MONITOR_NONE,
+                                          NULL,
+                                          NULL);
+    if (resolv_monitor) {
+        g_signal_connect (resolv_monitor,
+                          "changed", G_CALLBACK (on_resolv_changed),
+                          NULL);
+    }
+}
+
+/* returns TRUE if we received an entire request, of either size */
+static
+gboolean
+is_complete_request (struct nss_tls_session *session, const gsize len)
+{
+    if (len == NSS_TLS_REQ_V1_SIZE) {
+        session->request.prio = NSS_TLS_PRIO_INTERACTIVE;
+        return TRUE;
+    }
+
+    return len == sizeof (session->request);
+}
+
+static
+void
+handle_request (struct nss_tls_session *session)
+{
+    session->request.name[sizeof (session->request.name) - 1] = '\0';
+
+    if (!nss_tls_normalize_name (session->request.name, &session->hash)) {
+        g_debug ("Bad name: %s", session->request.name);
+        goto fail;
+    }
+
+    if (nss_tls_is_suffixed (session->request.name) ||
+        is_server_domain (session->request.name)) {
+        goto fail;
+    }
+
+    if (resolve_domain (session)) {
+        return;
+    }
+
+fail:
+    stop_session (session);
+}
+
+#ifdef NSS_TLS_GIO_FRONTEND
+
+static
+void
+on_close (GObject       *source_object,
+          GAsyncResult  *res,
+          gpointer      user_data)
+{
+    struct nss_tls_session *session = (struct nss_tls_session *)user_data;
+
+    g_io_stream_close_finish (G_IO_STREAM (source_object), res, NULL);
+
+    g_object_unref (session->connection);
+
+    free_session (session);
+}
+
+static
+void
+close_client (struct nss_tls_session *session)
+{
+    g_io_stream_close_async (G_IO_STREAM (session->connection),
+                             G_PRIORITY_DEFAULT,
+                             NULL,
+                             on_close,
+                             session);
+}
+
+/* step 4: we're done sending the response to libnss_tls */
+static
+void
+on_sent (GObject         *source_object,
+         GAsyncResult    *res,
+         gpointer        user_data)
+{
+    struct nss_tls_session *session = (struct nss_tls_session *)user_data;
+    gsize out;
+
+    g_output_stream_write_all_finish (G_OUTPUT_STREAM (source_object),
+                                      res,
+                                      &out,
+                                      NULL);
+    stop_session (session);
+}
+
+static
+void
+reply_to_client (struct nss_tls_session *session)
+{
+    GOutputStream *out;
+
+    out = g_io_stream_get_output_stream (G_IO_STREAM (session->connection));
+    g_output_stream_write_all_async (out,
+                                     &session->response,
+                                     sizeof (session->response),
+                                     G_PRIORITY_DEFAULT,
+                                     NULL,
+                                     on_sent,
+                                     session);
+}
+
+/* step 2: we received a request from libnss_tls and send a HTTPS request */
+static
+void
+on_request (GObject         *source_object,
+            GAsyncResult    *res,
+            gpointer        user_data)
+{
+    g_autoptr(GError) err = NULL;
+    struct nss_tls_session *session = user_data;
+    gsize len;
+
+    if (!g_input_stream_read_all_finish (G_INPUT_STREAM (source_object),
+                                         res,
+                                         &len,
+                                         &err)) {
+        if (err) {
+            g_warning ("Failed to receive a request: %s", err->message);
+        }
+        else {
+            g_warning ("Failed to receive a request");
+        }
+        stop_session (session);
+        return;
+    }
+
+    if (!is_complete_request (session, (gsize)len)) {
+        g_debug ("Bad request");
+        stop_session (session);
+        return;
+    }
+
+    handle_request (session);
+}
+
+/* step 1: we accept a new connection from libnss_tls and wait for it to send a
+ * request */
+static
+void
+on_connection (GSocketService     *service,
+               GSocketConnection  *connection,
+               GObject            *source_object,
+               gpointer           user_data)
+{
+    GSocket *s;
+    struct nss_tls_session *session;
+    GInputStream *in;
+
+    /* we disconnect the client after NSS_TLS_TIMEOUT seconds */
+    s = g_socket_connection_get_socket (connection);
+    g_socket_set_timeout (s, NSS_TLS_TIMEOUT);
+
+    session = g_new0 (struct nss_tls_session, 1);
+    session->connection = g_object_ref (connection);
+    session->response.count = 0;
+    session->response.expiry = -1;
+    session->ttl = -1;
+    session->accepted = g_get_monotonic_time ();
+
+    NSS_TLS_PROBE (accept,
+                   g_socket_get_fd (g_socket_connection_get_socket (connection)));
+
+    /* we assume the domain is not canonical */
+    session->canon = FALSE;
+
+    in = g_io_stream_get_input_stream (G_IO_STREAM (connection));
+    /*
+     * read the incoming request: we read it with one read(), because older
+     * versions of libnss_tls send shorter requests
+     */
+    g_input_stream_read_async (in,
+                               &session->request,
+                               sizeof (session->request),
+                               G_PRIORITY_DEFAULT,
+                               NULL,
+                               on_request,
+                               session);
+}
+
+static
+GObject *
+listen_clients (const gchar *path)
+{
+    GSocketService *s;
+    g_autoptr(GSocketAddress) sa = NULL;
+
+    sa = g_unix_socket_address_new (path);
+    s = g_socket_service_new ();
+
+    if (!g_socket_listener_add_address (G_SOCKET_LISTENER (s),
+                                        sa,
+                                        G_SOCKET_TYPE_STREAM,
+                                        0,
+                                        NULL,
+                                        NULL,
+                                        NULL)) {
+        g_object_unref (s);
+        return NULL;
+    }
+
+    g_signal_connect (s,
+                      "incoming",
+                      G_CALLBACK (on_connection),
+                      NULL);
+    g_socket_service_start (s);
+
+    return G_OBJECT (s);
+}
+
+#else
+
+/*
+ * sessions waiting for libnss_tls to send a request or receive a response,
+ * ordered by their deadline
+ */
+static GQueue waiting = G_QUEUE_INIT;
+
+static
+void
+close_client (struct nss_tls_session *session)
+{
+    if (session->watch) {
+        g_source_remove (session->watch);
+    }
+
+    if (session->link.data) {
+        g_queue_unlink (&waiting, &session->link);
+    }
+
+    close (session->fd);
+    free_session (session);
+}
+
+static
+void
+wait_for_client (struct nss_tls_session *session)
+{
+    session->deadline = g_get_monotonic_time () + NSS_TLS_TIMEOUT * 1000000;
+    session->link.data = session;
+    g_queue_push_tail_link (&waiting, &session->link);
+}
+
+static
+void
+stop_waiting (struct nss_tls_session *session)
+{
+    session->watch = 0;
+    g_queue_unlink (&waiting, &session->link);
+    session->link.data = NULL;
+}
+
+/* returns FALSE if we need to wait until the client's socket is writable */
+static
+gboolean
+write_response (struct nss_tls_session *session)
+{
+    const unsigned char *buf = (const unsigned char *)&session->response;
+    ssize_t out;
+
+    while (session->off < sizeof (session->response)) {
+        out = send (session->fd,
+                    buf + session->off,
+                    sizeof (session->response) - session->off,
+                    MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (out < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return ((errno != EAGAIN) && (errno != EWOULDBLOCK));
+        }
+
+        session->off += (gsize)out;
+    }
+
+    return TRUE;
+}
+
+/* step 4: we're done sending the response to libnss_tls */
+static
+gboolean
+on_writable (gint          fd,
+             GIOCondition  condition,
+             gpointer      user_data)
+{
+    struct nss_tls_session *session = (struct nss_tls_session *)user_data;
+
+    if (!write_response (session)) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    stop_waiting (session);
+    close_client (session);
+    return G_SOURCE_REMOVE;
+}
+
+#ifdef NSS_TLS_URING
+
+static
+void
+reply_uring (struct nss_tls_session *session);
+
+#endif
+
+static
+void
+reply_to_client (struct nss_tls_session *session)
+{
+#ifdef NSS_TLS_URING
+    if (session->uring) {
+        reply_uring (session);
+        return;
+    }
+#endif
+
+    session->off = 0;
+
+    /* usually, the entire response fits in the socket buffer */
+    if (write_response (session)) {
+        close_client (session);
+        return;
+    }
+
+    wait_for_client (session);
+    session->watch = g_unix_fd_add (session->fd,
+                                    G_IO_OUT,
+                                    on_writable,
+                                    session);
+}
+
+/*
+ * returns 1 if we have the entire request, 0 if we need to wait for the rest
+ * of it or -1 on error
+ */
+static
+int
+read_request (struct nss_tls_session *session)
+{
+    unsigned char *buf = (unsigned char *)&session->request;
+    ssize_t in;
+
+    while (session->off < sizeof (session->request)) {
+        in = recv (session->fd,
+                   buf + session->off,
+                   sizeof (session->request) - session->off,
+                   MSG_DONTWAIT);
+        if (in < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                return is_complete_request (session, session->off) ? 1 : 0;
+            }
+
+            g_warning ("Failed to receive a request: %s", g_strerror (errno));
+            return -1;
+        }
+
+        if (in == 0) {
+            g_debug ("Bad request");
+            return -1;
+        }
+
+        session->off += (gsize)in;
+    }
+
+    return 1;
+}
+
+/* step 2: we received a request from libnss_tls and send a HTTPS request */
+static
+gboolean
+on_readable (gint          fd,
+             GIOCondition  condition,
+             gpointer      user_data)
+{
+    struct nss_tls_session *session = (struct nss_tls_session *)user_data;
+
+    switch (read_request (session)) {
+    case 0:
+        return G_SOURCE_CONTINUE;
+
+    case 1:
+        stop_waiting (session);
+        handle_request (session);
+        break;
+
+    default:
+        stop_waiting (session);
+        close_client (session);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+/* step 1: we accept a new connection from libnss_tls and wait for it to send a
+ * request */
+static
+gboolean
+on_connection (gint          fd,
+               GIOCondition  condition,
+               gpointer      user_data)
+{
+    struct nss_tls_session *session;
+    int s;
+
+    for (;;) {
+        s = accept4 (fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (s < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            break;
+        }
+
+        session = g_new0 (struct nss_tls_session, 1);
+        session->fd = s;
+        session->response.count = 0;
+        session->response.expiry = -1;
+        session->ttl = -1;
+        session->accepted = g_get_monotonic_time ();
+
+        NSS_TLS_PROBE (accept, s);
+
+        /* we assume the domain is not canonical */
+        session->canon = FALSE;
+
+        /* usually, libnss_tls sends the request right after connecting */
+        switch (read_request (session)) {
+        case 0:
+            wait_for_client (session);
+            session->watch = g_unix_fd_add (s,
+                                            G_IO_IN,
+                                            on_readable,
+                                            session);
+            break;
+
+        case 1:
+            handle_request (session);
+            break;
+
+        default:
+            close_client (session);
+        }
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/* we disconnect the client after NSS_TLS_TIMEOUT seconds */
+static
+gboolean
+on_client_timeout (gpointer user_data)
+{
+    struct nss_tls_session *session;
+    gint64 now;
+
+    now = g_get_monotonic_time ();
+
+    while ((session = g_queue_peek_head (&waiting)) &&
+           (session->deadline <= now)) {
+        g_debug ("Timed out waiting for a client");
+        close_client (session);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+#ifdef NSS_TLS_URING
+
+/*
+ * with io_uring, a lookup answered from the cache costs a single
+ * io_uring_enter() call: connections are accepted by a multishot accept
+ * request, requests are read into buffers provided by us and the response
+ * is sent by a write request linked to a close request
+ */
+#define URING_ENTRIES 256
+#define URING_BUFS 64
+#define URING_BGID 0
+
+enum nss_tls_uring_ops {
+    URING_ACCEPT,
+    URING_RECV,
+    URING_TIMEOUT,
+    URING_SEND,
+    URING_CLOSE,
+    URING_OPS_MASK = 7
+};
+
+static struct {
+    struct io_uring ring;
+    struct io_uring_buf_ring *br;
+    struct nss_tls_req bufs[URING_BUFS];
+    int listener;
+    gboolean busy;
+} uring;
+
+static
+struct io_uring_sqe *
+get_uring_sqe (gpointer                     data,
+               const enum nss_tls_uring_ops op)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = io_uring_get_sqe (&uring.ring);
+    if (!sqe) {
+        io_uring_submit (&uring.ring);
+        sqe = io_uring_get_sqe (&uring.ring);
+    }
+
+    io_uring_sqe_set_data64 (sqe, (guint64)(guintptr)data | op);
+    return sqe;
+}
+
+/* linked requests must be submitted together */
+static
+void
+reserve_uring_sqes (const guint count)
+{
+    if (io_uring_sq_space_left (&uring.ring) < count) {
+        io_uring_submit (&uring.ring);
+    }
+}
+
+static
+void
+submit_uring (void)
+{
+    /* if we're handling completions, we submit everything when we're done */
+    if (!uring.busy) {
+        io_uring_submit (&uring.ring);
+    }
+}
+
+static
+void
+accept_uring (void)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = get_uring_sqe (NULL, URING_ACCEPT);
+    io_uring_prep_multishot_accept (sqe, uring.listener, NULL, NULL, SOCK_CLOEXEC);
+}
+
+static
+void
+read_uring (struct nss_tls_session *session)
+{
+    static struct __kernel_timespec timeout = {.tv_sec = NSS_TLS_TIMEOUT};
+    struct io_uring_sqe *sqe;
+
+    reserve_uring_sqes (2);
+
+    sqe = get_uring_sqe (session, URING_RECV);
+    io_uring_prep_recv (sqe, session->fd, NULL, sizeof (session->request), 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT | IOSQE_IO_LINK;
+    sqe->buf_group = URING_BGID;
+
+    /* we disconnect the client after NSS_TLS_TIMEOUT seconds */
+    sqe = get_uring_sqe (NULL, URING_TIMEOUT);
+    io_uring_prep_link_timeout (sqe, &timeout, 0);
+}
+
+static
+void
+reply_uring (struct nss_tls_session *session)
+{
+    struct io_uring_sqe *sqe;
+
+    reserve_uring_sqes (2);
+
+    sqe = get_uring_sqe (session, URING_SEND);
+    io_uring_prep_send (sqe,
+                        session->fd,
+                        &session->response,
+                        sizeof (session->response),
+                        MSG_NOSIGNAL);
+    sqe->flags |= IOSQE_IO_LINK;
+
+    /* the session is freed once the socket is closed */
+    sqe = get_uring_sqe (session, URING_CLOSE);
+    io_uring_prep_close (sqe, session->fd);
+
+    submit_uring ();
+}
+
+static
+void
+on_uring_request (struct nss_tls_session    *session,
+                  const struct io_uring_cqe *cqe)
+{
+    guint bid;
+
+    if (cqe->res == -ENOBUFS) {
+        /* all buffers are in use, so we wait for the request without one */
+        wait_for_client (session);
+        session->watch = g_unix_fd_add (session->fd,
+                                        G_IO_IN,
+                                        on_readable,
+                                        session);
+        return;
+    }
+
+    if (cqe->res <= 0) {
+        g_debug ("Bad request");
+        close_client (session);
+        return;
+    }
+
+    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    memcpy (&session->request, &uring.bufs[bid], (gsize)cqe->res);
+    session->off = (gsize)cqe->res;
+
+    io_uring_buf_ring_add (uring.br,
+                           &uring.bufs[bid],
+                           sizeof (uring.bufs[bid]),
+                           bid,
+                           io_uring_buf_ring_mask (URING_BUFS),
+                           0);
+    io_uring_buf_ring_advance (uring.br, 1);
+
+    if (is_complete_request (session, session->off)) {
+        handle_request (session);
+        return;
+    }
+
+    /* we received a partial request */
+    wait_for_client (session);
+    session->watch = g_unix_fd_add (session->fd,
+                                    G_IO_IN,
+                                    on_readable,
+                                    session);
+}
+
+static
+void
+on_uring_connection (const struct io_uring_cqe *cqe)
+{
+    struct nss_tls_session *session;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        if (cqe->res == -EINVAL) {
+            /* multishot accept is not supported by this kernel */
+            g_debug ("Falling back to accept()");
+            g_unix_fd_add (uring.listener, G_IO_IN, on_connection, NULL);
+            return;
+        }
+
+        accept_uring ();
+    }
+
+    if (cqe->res < 0) {
+        return;
+    }
+
+    session = g_new0 (struct nss_tls_session, 1);
+    session->fd = cqe->res;
+    session->uring = TRUE;
+    session->response.count = 0;
+    session->response.expiry = -1;
+    session->ttl = -1;
+    session->accepted = g_get_monotonic_time ();
+
+    NSS_TLS_PROBE (accept, session->fd);
+
+    /* we assume the domain is not canonical */
+    session->canon = FALSE;
+
+    read_uring (session);
+}
+
+static
+gboolean
+on_uring (gint          fd,
+          GIOCondition  condition,
+          gpointer      user_data)
+{
+    struct io_uring_cqe *cqe;
+    struct nss_tls_session *session;
+    guint head, count = 0;
+
+    uring.busy = TRUE;
+
+    io_uring_for_each_cqe (&uring.ring, head, cqe) {
+        session = (struct nss_tls_session *)(guintptr)(
+            io_uring_cqe_get_data64 (cqe) & ~(guint64)URING_OPS_MASK
+        );
+
+        switch (io_uring_cqe_get_data64 (cqe) & URING_OPS_MASK) {
+        case URING_ACCEPT:
+            on_uring_connection (cqe);
+            break;
+
+        case URING_RECV:
+            on_uring_request (session, cqe);
+            break;
+
+        case URING_CLOSE:
+            /* if the response was not sent, the close request is canceled */
+            if (cqe->res == -ECANCELED) {
+                close (session->fd);
+            }
+            free_session (session);
+            break;
+        }
+
+        ++count;
+    }
+
+    io_uring_cq_advance (&uring.ring, count);
+
+    uring.busy = FALSE;
+    io_uring_submit (&uring.ring);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static
+gboolean
+init_uring (const int listener)
+{
+    int i, ret;
+
+    if (io_uring_queue_init (URING_ENTRIES, &uring.ring, 0) < 0) {
+        return FALSE;
+    }
+
+    uring.br = io_uring_setup_buf_ring (&uring.ring,
+                                        URING_BUFS,
+                                        URING_BGID,
+                                        0,
+                                        &ret);
+    if (!uring.br) {
+        io_uring_queue_exit (&uring.ring);
+        return FALSE;
+    }
+
+    for (i = 0; i < URING_BUFS; ++i) {
+        io_uring_buf_ring_add (uring.br,
+                               &uring.bufs[i],
+                               sizeof (uring.bufs[i]),
+                               i,
+                               io_uring_buf_ring_mask (URING_BUFS),
+                               i);
+    }
+    io_uring_buf_ring_advance (uring.br, URING_BUFS);
+
+    uring.listener = listener;
+    accept_uring ();
+    io_uring_submit (&uring.ring);
+
+    g_unix_fd_add (uring.ring.ring_fd, G_IO_IN, on_uring, NULL);
+
+    return TRUE;
+}
+
+#endif
+
+static
+int
+listen_clients (const gchar *path)
+{
+    struct sockaddr_un sun = {.sun_family = AF_UNIX};
+    int s;
+
+    if (strlen (path) >= sizeof (sun.sun_path)) {
+        return -1;
+    }
+    strcpy (sun.sun_path, path);
+
+    s = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s < 0) {
+        return -1;
+    }
+
+    if ((bind (s, (const struct sockaddr *)&sun, sizeof (sun)) < 0) ||
+        (listen (s, SOMAXCONN) < 0)) {
+        close (s);
+        return -1;
+    }
+
+#ifdef NSS_TLS_URING
+    if (!init_uring (s)) {
+        g_debug ("io_uring is unavailable");
+        g_unix_fd_add (s, G_IO_IN, on_connection, NULL);
+    }
+#else
+    g_unix_fd_add (s, G_IO_IN, on_connection, NULL);
+#endif
+    g_timeout_add_seconds (1, on_client_timeout, NULL);
+
+    return s;
+}
+
+#endif
+
+/*
+ * the local DNS listener serves applications with a built-in DNS resolver: A
+ * and AAAA queries go through the same cache as lookups made by libnss_tls,
+ * while other queries are forwarded as-is to the DoH server
+ */
+static struct {
+    struct mmsghdr msgs[STUB_BATCH];
+    struct iovec iovs[STUB_BATCH];
+    struct sockaddr_storage peers[STUB_BATCH];
+    unsigned char bufs[STUB_BATCH][STUB_UDP_SIZE];
+    guint count;
+    gboolean active;
+} stub_rx, stub_tx;
+
+static
+void
+on_stub_length (GObject         *source_object,
+                GAsyncResult    *res,
+                gpointer        user_data);
+
+static
+void
+on_stub_conn_closed (GObject       *source_object,
+                     GAsyncResult  *res,
+                     gpointer      user_data)
+{
+    struct nss_tls_stub_conn *conn = (struct nss_tls_stub_conn *)user_data;
+
+    g_io_stream_close_finish (G_IO_STREAM (source_object), res, NULL);
+
+    g_object_unref (conn->connection);
+
+    g_free (conn);
+}
+
+static
+void
+stop_stub_conn (struct nss_tls_stub_conn *conn)
+{
+    g_io_stream_close_async (G_IO_STREAM (conn->connection),
+                             G_PRIORITY_DEFAULT,
+                             NULL,
+                             on_stub_conn_closed,
+                             conn);
+}
+
+static
+void
+read_stub_query (struct nss_tls_stub_conn *conn)
+{
+    GInputStream *in;
+
+    in = g_io_stream_get_input_stream (G_IO_STREAM (conn->connection));
+    g_input_stream_read_all_async (in,
+                                   &conn->len,
+                                   sizeof (conn->len),
+                                   G_PRIORITY_DEFAULT,
+                                   NULL,
+                                   on_stub_length,
+                                   conn);
+}
+
+static
+void
+on_stub_sent (GObject         *source_object,
+              GAsyncResult    *res,
+              gpointer        user_data)
+{
+    struct nss_tls_stub_conn *conn = (struct nss_tls_stub_conn *)user_data;
+
+    if (!g_output_stream_write_all_finish (G_OUTPUT_STREAM (source_object),
+                                           res,
+                                           NULL,
+                                           NULL)) {
+        stop_stub_conn (conn);
+        return;
+    }
+
+    /* wait for the next query over the same connection */
+    read_stub_query (conn);
+}
+
+static
+unsigned char *
+put_stub_rr (unsigned char          *p,
+             const unsigned char    *eom,
+             const guint            owner,
+             const guint            type,
+             const guint32          ttl,
+             const unsigned char    *rdata,
+             const guint            rdlen)
+{
+    if (!p || (eom - p < NS_INT16SZ + NS_RRFIXEDSZ + rdlen)) {
+        return NULL;
+    }
+
+    NS_PUT16 ((NS_CMPRSFLGS << 8) | owner, p);
+    NS_PUT16 (type, p);
+    NS_PUT16 (ns_c_in, p);
+    NS_PUT32 (ttl, p);
+    NS_PUT16 (rdlen, p);
+    memcpy (p, rdata, rdlen);
+
+    return p + rdlen;
+}
+
+static
+gsize
+build_stub_reply (const struct nss_tls_session  *session,
+                  unsigned char                 *buf,
+                  const gsize                   size,
+                  const int                     rcode)
+{
+    const struct nss_tls_stub_query *query = session->stub;
+    unsigned char cname[NS_MAXCDNAME], *p, *eom = buf + size;
+    HEADER *hdr = (HEADER *)buf;
+    gint64 ttl = 0;
+    gsize alen, rdlen;
+    guint owner = NS_HFIXEDSZ, ancount = 0, i;
+    int len;
+
+    if (size < NS_HFIXEDSZ + query->qlen) {
+        return 0;
+    }
+
+    if ((rcode == ns_r_noerror) && (session->request.af == AF_UNSPEC)) {
+        if (query->alen > size) {
+            memcpy (buf, session->dns, NS_HFIXEDSZ);
+            memcpy (buf + NS_HFIXEDSZ, query->question, query->qlen);
+            hdr->tc = 1;
+            hdr->qdcount = htons (1);
+            hdr->ancount = hdr->nscount = hdr->arcount = 0;
+            alen = NS_HFIXEDSZ + query->qlen;
+        } else {
+            alen = query->alen;
+            memcpy (buf, session->dns, alen);
+        }
+
+        hdr->id = query->id;
+        return alen;
+    }
+
+    memset (hdr, 0, NS_HFIXEDSZ);
+    hdr->id = query->id;
+    hdr->qr = 1;
+    hdr->opcode = ns_o_query;
+    hdr->rd = query->rd;
+    hdr->ra = 1;
+    hdr->rcode = rcode;
+    hdr->qdcount = htons (query->qlen ? 1 : 0);
+
+    memcpy (buf + NS_HFIXEDSZ, query->question, query->qlen);
+    p = buf + NS_HFIXEDSZ + query->qlen;
+
+    /* the canonical name of a name that does not exist is still an answer */
+    if ((rcode != ns_r_noerror) && (rcode != ns_r_nxdomain)) {
+        return p - buf;
+    }
+
+    if (session->response.expiry != -1) {
+        ttl = (session->response.expiry - g_get_monotonic_time ()) / 1000000;
+        ttl = CLAMP (ttl, 0, G_MAXINT32);
+    }
+
+    if (session->response.cname[0]) {
+        len = dn_comp (session->response.cname,
+                       cname,
+                       sizeof (cname),
+                       NULL,
+                       NULL);
+        if (len <= 0) {
+            return p - buf;
+        }
+
+        p = put_stub_rr (p,
+                         eom,
+                         owner,
+                         ns_t_cname,
+                         (guint32)ttl,
+                         cname,
+                         (guint)len);
+        if (!p) {
+            goto truncate;
+        }
+
+        /* the addresses belong to the canonical name */
+        owner = (guint)(p - len - buf);
+        ++ancount;
+    }
+
+    rdlen = (session->request.af == AF_INET) ?
+            sizeof (session->response.addrs[0].in) :
+            sizeof (session->response.addrs[0].in6);
+
+    for (i = 0; i < session->response.count; ++i) {
+        p = put_stub_rr (p,
+                         eom,
+                         owner,
+                         (session->request.af == AF_INET) ? ns_t_a : ns_t_aaaa,
+                         (guint32)ttl,
+                         (const unsigned char *)&session->response.addrs[i],
+                         (guint)rdlen);
+        if (!p) {
+            goto truncate;
+        }
+
+        ++ancount;
+    }
+
+    hdr->ancount = htons (ancount);
+    return p - buf;
+
+truncate:
+    hdr->tc = 1;
+    return NS_HFIXEDSZ + query->qlen;
+}
+
+static
+void
+stub_reply (struct nss_tls_session *session, const int rcode)
+{
+    static unsigned char buf[STUB_UDP_SIZE];
+    struct nss_tls_stub_query *query = session->stub;
+    struct nss_tls_stub_conn *conn = query->conn;
+    GOutputStream *out;
+    struct iovec *iov;
+    gsize len;
+    guint16 nlen;
+
+    if (conn) {
+        len = build_stub_reply (session,
+                                conn->buf + sizeof (nlen),
+                                sizeof (conn->buf) - sizeof (nlen),
+                                rcode);
+        if (len == 0) {
+            stop_stub_conn (conn);
+            goto out;
+        }
+
+        nlen = htons ((guint16)len);
+        memcpy (conn->buf, &nlen, sizeof (nlen));
+
+        out = g_io_stream_get_output_stream (G_IO_STREAM (conn->connection));
+        g_output_stream_write_all_async (out,
+                                         conn->buf,
+                                         sizeof (nlen) + len,
+                                         G_PRIORITY_DEFAULT,
+                                         NULL,
+                                         on_stub_sent,
+                                         conn);
+    } else if (stub_tx.active && (stub_tx.count < STUB_BATCH)) {
+        /*
+         * cache hits are answered while we're still going over a batch of
+         * queries, so we send all of them at once when we're done
+         */
+        len = build_stub_reply (session,
+                                stub_tx.bufs[stub_tx.count],
+                                sizeof (stub_tx.bufs[0]),
+                                rcode);
+        if (len > 0) {
+            memcpy (&stub_tx.peers[stub_tx.count],
+                    &query->peer,
+                    query->peerlen);
+
+            iov = &stub_tx.iovs[stub_tx.count];
+            iov->iov_base = stub_tx.bufs[stub_tx.count];
+            iov->iov_len = len;
+
+            stub_tx.msgs[stub_tx.count].msg_hdr.msg_name = &stub_tx.peers[stub_tx.count];
+            stub_tx.msgs[stub_tx.count].msg_hdr.msg_namelen = query->peerlen;
+            stub_tx.msgs[stub_tx.count].msg_hdr.msg_iov = iov;
+            stub_tx.msgs[stub_tx.count].msg_hdr.msg_iovlen = 1;
+
+            ++stub_tx.count;
+        }
+    } else {
+        len = build_stub_reply (session, buf, sizeof (buf), rcode);
+        if (len > 0) {
+            sendto (query->fd,
+                    buf,
+                    len,
+                    MSG_DONTWAIT | MSG_NOSIGNAL,
+                    (const struct sockaddr *)&query->peer,
+                    query->peerlen);
+        }
+    }
+
+out:
+    g_free (query);
+    free_session (session);
+}
+
+static
+void
+on_stub_query (struct nss_tls_stub_query    *query,
+               unsigned char                *buf,
+               const gsize                  len)
+{
+    struct nss_tls_session *session;
+    const unsigned char *eom = buf + len;
+    const HEADER *hdr = (const HEADER *)buf;
+    int qlen, qtype, qclass;
+    gchar *p;
+
+    session = g_new0 (struct nss_tls_session, 1);
+    session->stub = query;
+    session->response.count = 0;
+    session->response.expiry = -1;
+    session->ttl = -1;
+    session->accepted = g_get_monotonic_time ();
+    session->canon = FALSE;
+
+    if ((len < NS_HFIXEDSZ) || hdr->qr) {
+        goto ignore;
+    }
+
+    query->id = hdr->id;
+    query->rd = hdr->rd;
+
+    qlen = dn_skipname (buf + NS_HFIXEDSZ, eom);
+    if ((hdr->opcode != ns_o_query) ||
+        (ntohs (hdr->qdcount) != 1) ||
+        (qlen <= 0) ||
+        (eom - buf - NS_HFIXEDSZ < qlen + NS_QFIXEDSZ) ||
+        (qlen + NS_QFIXEDSZ > sizeof (query->question))) {
+        query->qlen = 0;
+        stub_reply (session, ns_r_formerr);
+        return;
+    }
+
+    query->qlen = (gsize)qlen + NS_QFIXEDSZ;
+    memcpy (query->question, buf + NS_HFIXEDSZ, query->qlen);
+
+    if (dn_expand (buf,
+                   eom,
+                   buf + NS_HFIXEDSZ,
+                   session->request.name,
+                   sizeof (session->request.name)) <= 0) {
+        stub_reply (session, ns_r_formerr);
+        return;
+    }
+
+    qtype = ns_get16 (buf + NS_HFIXEDSZ + qlen);
+    qclass = ns_get16 (buf + NS_HFIXEDSZ + qlen + NS_INT16SZ);
+
+    /*
+     * the checks below are case-sensitive; names of queries forwarded as-is
+     * may not pass normalization (e.g. the root), so we only lowercase them
+     */
+    if ((qclass == ns_c_in) && ((qtype == ns_t_a) || (qtype == ns_t_aaaa))) {
+        if (!nss_tls_normalize_name (session->request.name, &session->hash)) {
+            stub_reply (session, ns_r_formerr);
+            return;
+        }
+    } else {
+        for (p = session->request.name; *p; ++p) {
+            *p = g_ascii_tolower (*p);
+        }
+    }
+
+    if (nss_tls_is_suffixed (session->request.name) ||
+        is_server_domain (session->request.name)) {
+        stub_reply (session, ns_r_refused);
+        return;
+    }
+
+    if ((qclass == ns_c_in) && (qtype == ns_t_a)) {
+        session->request.af = AF_INET;
+    } else if ((qclass == ns_c_in) && (qtype == ns_t_aaaa)) {
+        session->request.af = AF_INET6;
+    } else {
+        session->request.af = AF_UNSPEC;
+
+        if ((len > MAX_REQ_SIZE) || !schedule_query (session, buf, (int)len)) {
+            stub_reply (session, ns_r_servfail);
+        }
+
+        return;
+    }
+
+    if (!resolve_domain (session)) {
+        stub_reply (session, ns_r_servfail);
+    }
+
+    return;
+
+ignore:
+    g_free (query);
+    free_session (session);
+}
+
+static
+void
+on_stub_body (GObject         *source_object,
+              GAsyncResult    *res,
+              gpointer        user_data)
+{
+    struct nss_tls_stub_conn *conn = (struct nss_tls_stub_conn *)user_data;
+    struct nss_tls_stub_query *query;
+    gsize len;
+
+    if (!g_input_stream_read_all_finish (G_INPUT_STREAM (source_object),
+                                         res,
+                                         &len,
+                                         NULL) ||
+        (len != ntohs (conn->len))) {
+        stop_stub_conn (conn);
+        return;
+    }
+
+    query = g_new0 (struct nss_tls_stub_query, 1);
+    query->conn = conn;
+    query->fd = -1;
+
+    on_stub_query (query, conn->buf, len);
+}
+
+static
+void
+on_stub_length (GObject         *source_object,
+                GAsyncResult    *res,
+                gpointer        user_data)
+{
+    struct nss_tls_stub_conn *conn = (struct nss_tls_stub_conn *)user_data;
+    GInputStream *in;
+    gsize len;
+
+    if (!g_input_stream_read_all_finish (G_INPUT_STREAM (source_object),
+                                         res,
+                                         &len,
+                                         NULL) ||
+        (len != sizeof (conn->len)) ||
+        (ntohs (conn->len) < NS_HFIXEDSZ)) {
+        stop_stub_conn (conn);
+        return;
+    }
+
+    in = g_io_stream_get_input_stream (G_IO_STREAM (conn->connection));
+    g_input_stream_read_all_async (in,
+                                   conn->buf,
+                                   ntohs (conn->len),
+                                   G_PRIORITY_DEFAULT,
+                                   NULL,
+                                   on_stub_body,
+                                   conn);
+}
+
+static
+void
+on_stub_connection (GSocketService     *service,
+                    GSocketConnection  *connection,
+                    GObject            *source_object,
+                    gpointer           user_data)
+{
+    struct nss_tls_stub_conn *conn;
+
+    /* we disconnect idle clients after NSS_TLS_TIMEOUT seconds */
+    g_socket_set_timeout (g_socket_connection_get_socket (connection),
+                          NSS_TLS_TIMEOUT);
+
+    conn = g_new0 (struct nss_tls_stub_conn, 1);
+    conn->connection = g_object_ref (connection);
+
+    read_stub_query (conn);
+}
+
+static
+gboolean
+on_stub_datagrams (gint          fd,
+                   GIOCondition  condition,
+                   gpointer      user_data)
+{
+    struct nss_tls_stub_query *query;
+    int i, count;
+
+    for (i = 0; i < STUB_BATCH; ++i) {
+        stub_rx.iovs[i].iov_base = stub_rx.bufs[i];
+        stub_rx.iovs[i].iov_len = sizeof (stub_rx.bufs[i]);
+        stub_rx.msgs[i].msg_hdr.msg_name = &stub_rx.peers[i];
+        stub_rx.msgs[i].msg_hdr.msg_namelen = sizeof (stub_rx.peers[i]);
+        stub_rx.msgs[i].msg_hdr.msg_iov = &stub_rx.iovs[i];
+        stub_rx.msgs[i].msg_hdr.msg_iovlen = 1;
+        stub_rx.msgs[i].msg_hdr.msg_control = NULL;
+        stub_rx.msgs[i].msg_hdr.msg_controllen = 0;
+        stub_rx.msgs[i].msg_hdr.msg_flags = 0;
+    }
+
+    count = recvmmsg (fd, stub_rx.msgs, STUB_BATCH, MSG_DONTWAIT, NULL);
+    if (count <= 0) {
+        return G_SOURCE_CONTINUE;
+    }
+
+    stub_tx.count = 0;
+    stub_tx.active = TRUE;
+
+    for (i = 0; i < count; ++i) {
+        if (stub_rx.msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            continue;
+        }
+
+        query = g_new0 (struct nss_tls_stub_query, 1);
+        query->fd = fd;
+        memcpy (&query->peer,
+                &stub_rx.peers[i],
+                stub_rx.msgs[i].msg_hdr.msg_namelen);
+        query->peerlen = stub_rx.msgs[i].msg_hdr.msg_namelen;
+
+        on_stub_query (query, stub_rx.bufs[i], stub_rx.msgs[i].msg_len);
+    }
+
+    stub_tx.active = FALSE;
+
+    if (stub_tx.count > 0) {
+        sendmmsg (fd, stub_tx.msgs, stub_tx.count, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+/*
+ * we bind the listening sockets before we drop privileges, so we can use port
+ * 53
+ */
+static
+gboolean
+listen_stub (const gchar        *addr,
+             GSocket            **udp,
+             GSocketService     **tcp)
+{
+    g_autoptr(GSocketConnectable) connectable = NULL;
+    g_autoptr(GInetAddress) host = NULL;
+    g_autoptr(GSocketAddress) sa = NULL;
+    g_autoptr(GSocket) s = NULL;
+    g_autoptr(GError) err = NULL;
+    GSocketFamily family;
+
+    connectable = g_network_address_parse (addr, NS_DEFAULTPORT, &err);
+    if (!connectable) {
+        g_warning ("Bad listening address %s: %s", addr, err->message);
+        return FALSE;
+    }
+
+    host = g_inet_address_new_from_string (
+        g_network_address_get_hostname (G_NETWORK_ADDRESS (connectable))
+    );
+    if (!host) {
+        g_warning ("Bad listening address: %s", addr);
+        return FALSE;
+    }
+
+    sa = g_inet_socket_address_new (
+        host,
+        g_network_address_get_port (G_NETWORK_ADDRESS (connectable))
+    );
+    family = g_socket_address_get_family (sa);
+
+    *udp = g_socket_new (family,
+                         G_SOCKET_TYPE_DATAGRAM,
+                         G_SOCKET_PROTOCOL_UDP,
+                         &err);
+    if (!*udp || !g_socket_bind (*udp, sa, TRUE, &err)) {
+        g_warning ("Failed to listen on %s: %s", addr, err->message);
+        g_clear_object (udp);
+        return FALSE;
+    }
+
+    s = g_socket_new (family,
+                      G_SOCKET_TYPE_STREAM,
+                      G_SOCKET_PROTOCOL_TCP,
+                      &err);
+    if (!s ||
+        !g_socket_bind (s, sa, TRUE, &err) ||
+        !g_socket_listen (s, &err)) {
+        g_warning ("Failed to listen on %s: %s", addr, err->message);
+        g_clear_object (udp);
+        return FALSE;
+    }
+
+    *tcp = g_socket_service_new ();
+    if (!g_socket_listener_add_socket (G_SOCKET_LISTENER (*tcp),
+                                       s,
+                                       NULL,
+                                       &err)) {
+        g_warning ("Failed to listen on %s: %s", addr, err->message);
+        g_clear_object (tcp);
+        g_clear_object (udp);
+        return FALSE;
+    }
+
+    g_unix_fd_add (g_socket_get_fd (*udp),
+                   G_IO_IN,
+                   on_stub_datagrams,
+                   NULL);
+
+    g_signal_connect (*tcp,
+                      "incoming",
+                      G_CALLBACK (on_stub_connection),
+                      NULL);
+
+    return TRUE;
+}
+
+/*
+ * when tasks in our cgroup stall on memory, we halve the cache and release
+ * idle connections, with their buffers
+ */
+static
+gboolean
+on_memory_pressure (gint          fd,
+                    GIOCondition  condition,
+                    gpointer      user_data)
+{
+    guint budget, i;
+
+    if (condition & G_IO_ERR) {
+        g_warning ("Stopped monitoring memory pressure");
+        close (fd);
+        return G_SOURCE_REMOVE;
+    }
+
+    pressure_time = g_get_monotonic_time ();
+
+    budget = nss_tls_cache_get_budget ();
+    if (budget > MIN_CACHE_BUDGET) {
+        budget = MAX (budget / 2, MIN_CACHE_BUDGET);
+        g_debug ("Shrinking the cache to %u entries", budget);
+        nss_tls_cache_set_budget (budget);
+    }
+
+    for (i = 0; i < resolvers->len; ++i) {
+        ((struct nss_tls_resolver *)
+         g_ptr_array_index (resolvers, i))->conns = min_conns;
+    }
+    apply_pool_sizes ();
+
+    malloc_trim (0);
+
+    return G_SOURCE_CONTINUE;
+}
+
+/* we subscribe to PSI notifications of the cgroup we run in */
+static
+void
+watch_memory_pressure (void)
+{
+    g_autofree gchar *cgroups = NULL, *path = NULL;
+    gchar *cgroup, *end;
+    int fd;
+
+    if (!g_file_get_contents ("/proc/self/cgroup", &cgroups, NULL, NULL)) {
+        return;
+    }
+
+    /* with cgroup v2, there is one line: 0::/path */
+    if (strncmp (cgroups, "0::", 3) == 0) {
+        cgroup = cgroups + 3;
+    } else {
+        cgroup = strstr (cgroups, "\n0::");
+        if (!cgroup) {
+            return;
+        }
+        cgroup += 4;
+    }
+
+    end = strchr (cgroup, '\n');
+    if (end) {
+        *end = '\0';
+    }
+
+    path = g_build_filename ("/sys/fs/cgroup", cgroup, "memory.pressure", NULL);
+
+    fd = open (path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        g_debug ("Cannot monitor memory pressure: %s", g_strerror (errno));
+        return;
+    }
+
+    if (write (fd, PSI_TRIGGER, sizeof (PSI_TRIGGER)) < 0) {
+        g_debug ("Cannot monitor memory pressure: %s", g_strerror (errno));
+        close (fd);
+        return;
+    }
+
+    g_unix_fd_add (fd, G_IO_PRI | G_IO_ERR, on_memory_pressure, NULL);
+}
 
 static
 void
-on_body (GObject         *source_object,
-         GAsyncResult    *res,
-         gpointer        user_data)
+get_stats (GString *stats)
 {
-    ns_msg msg;
-    g_autoptr(GError) err = NULL;
-    struct nss_tls_session *session = (struct nss_tls_session *)user_data;
-    GOutputStream *out;
-    gsize len;
-    size_t addrlen;
-    int id, count, a_type;
+    struct nss_tls_resolver *resolver;
+    guint i;
 
-    if (!g_input_stream_read_all_finish (G_INPUT_STREAM (source_object),
-                                         res,
-                                         &len,
-                                         &err) ||
-        !len) {
-        goto cleanup;
+    for (i = 0; i < resolvers->len; ++i) {
+        resolver = g_ptr_array_index (resolvers, i);
+        g_string_append_printf (stats,
+                                "%s: %u queries in flight, %d connections, "
+                                "%"G_GINT64_FORMAT" us latency "
+                                "(%"G_GINT64_FORMAT" us POST, "
+                                "%"G_GINT64_FORMAT" us GET), "
+                                "%u throttled, %u rate limited\n",
+                                resolver->url,
+                                resolver->inflight,
+                                resolver->conns,
+                                resolver->latency,
+                                resolver->method_latency[NSS_TLS_METHOD_POST],
+                                resolver->method_latency[NSS_TLS_METHOD_GET],
+                                resolver->throttled,
+                                resolver->limited);
     }
 
-    switch (session->request.af) {
-    case AF_INET:
-        a_type = ns_t_a;
-        addrlen = sizeof (session->response.addrs[0].in);
-        break;
+    g_string_append_printf (stats,
+                            "%u queries in flight, %u interactive, %u bulk "
+                            "and %u background lookups queued\n",
+                            inflight,
+                            queued[NSS_TLS_PRIO_INTERACTIVE].length,
+                            queued[NSS_TLS_PRIO_BULK].length,
+                            queued[NSS_TLS_PRIO_BACKGROUND].length);
+
+    if (query_log) {
+        g_string_append_printf (stats,
+                                "%u query log records dropped\n",
+                                query_log->dropped);
+    }
 
-    case AF_INET6:
-        a_type = ns_t_aaaa;
-        addrlen = sizeof (session->response.addrs[0].in6);
-        break;
+    if (cache) {
+        g_string_append_printf (stats,
+                                "%u IPv4 and %u IPv6 names cached, "
+                                "up to %u each\n",
+                                nss_tls_cache_get_size (AF_INET),
+                                nss_tls_cache_get_size (AF_INET6),
+                                nss_tls_cache_get_budget ());
+    }
+}
 
-    default:
-        goto cleanup;
+static
+gboolean
+on_dump_stats (gpointer user_data)
+{
+    g_autoptr(GString) stats = g_string_new (NULL);
+    g_auto(GStrv) lines = NULL;
+    gchar **line;
+
+    get_stats (stats);
+
+    lines = g_strsplit (stats->str, "\n", -1);
+    for (line = lines; *line && **line; ++line) {
+        g_message ("%s", *line);
     }
 
-    if (ns_initparse (session->dns, (int)len, &msg) < 0) {
-        g_warning ("Failed to parse the result for %s", session->request.name);
-        goto cleanup;
+    return G_SOURCE_CONTINUE;
+}
+
+/*
+ * the admin socket accepts one command per connection, as a line of
+ * whitespace-separated words, and replies with text; errors start with
+ * "error: "
+ */
+struct nss_tls_admin_conn {
+    GSocketConnection *connection;
+    GDataInputStream *in;
+    GString *reply;
+};
+
+struct nss_tls_admin_cmd {
+    const gchar *name;
+    guint min_args;
+    guint max_args;
+    void (*run) (gchar **args, GString *reply);
+};
+
+static
+void
+on_log (const gchar     *domain,
+        GLogLevelFlags  level,
+        const gchar     *message,
+        gpointer        user_data)
+{
+    if ((level & G_LOG_LEVEL_MASK) > log_level) {
+        return;
     }
 
-    count = ns_msg_count(msg, ns_s_an);
-    for (id = 0;
-         ((id < count) &&
-          ((session->response.count < G_N_ELEMENTS (session->response.addrs)) ||
-          !session->response.cname[0]));
-         ++id) {
-        on_answer (session, session->dns, len, &msg, id, a_type, addrlen);
+    g_log_default_handler (domain, level, message, user_data);
+}
+
+/* the default handler drops informational and debug messages by default */
+static
+void
+set_log_level (const GLogLevelFlags level)
+{
+    log_level = level;
+
+#if GLIB_CHECK_VERSION (2, 72, 0)
+    g_log_set_debug_enabled (level >= G_LOG_LEVEL_INFO);
+#else
+    if (level >= G_LOG_LEVEL_INFO) {
+        g_setenv ("G_MESSAGES_DEBUG", "all", TRUE);
+    } else {
+        g_unsetenv ("G_MESSAGES_DEBUG");
     }
+#endif
+}
 
-    /* we want to cache addresses or the lack of any addresses */
-    add_to_cache (&session->request, &session->response);
+static
+gboolean
+parse_admin_name (const gchar   *arg,
+                  gchar         *name,
+                  guint         *hash,
+                  GString       *reply)
+{
+    if ((g_strlcpy (name, arg, NS_MAXDNAME) >= NS_MAXDNAME) ||
+        !nss_tls_normalize_name (name, hash)) {
+        g_string_append_printf (reply, "error: bad name: %s\n", arg);
+        return FALSE;
+    }
 
-    if (session->response.cname[0] && (session->response.count == 0)) {
-        resolve_cname (session);
+    return TRUE;
+}
+
+static
+gboolean
+check_admin_cache (GString *reply)
+{
+    if (!cache) {
+        g_string_append (reply, "error: the cache is disabled\n");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static
+void
+admin_flush (gchar **args, GString *reply)
+{
+    gchar name[NS_MAXDNAME];
+    guint hash, removed;
+
+    if (!check_admin_cache (reply)) {
         return;
     }
 
-    out = g_io_stream_get_output_stream (G_IO_STREAM (session->connection));
-    g_output_stream_write_all_async (out,
-                                     &session->response,
-                                     sizeof (session->response),
-                                     G_PRIORITY_DEFAULT,
-                                     NULL,
-                                     on_sent,
-                                     session);
+    if (args[0]) {
+        if (!parse_admin_name (args[0], name, &hash, reply)) {
+            return;
+        }
 
-    g_debug ("Done resolving %s with %hhu %s result(s)",
-             session->request.name,
-             session->response.count,
-             (session->request.af == AF_INET) ? "IPv4" : "IPv6");
+        removed = nss_tls_cache_remove (name, hash);
+    } else {
+        removed = nss_tls_cache_get_size (AF_INET) +
+                  nss_tls_cache_get_size (AF_INET6);
+        nss_tls_cache_flush ();
+    }
 
-    return;
+    g_string_append_printf (reply, "%u entries flushed\n", removed);
+}
 
-cleanup:
-    if (session->response.count == 0) {
+static
+void
+admin_flush_suffix (gchar **args, GString *reply)
+{
+    gchar suffix[NS_MAXDNAME];
+    guint hash;
+
+    if (check_admin_cache (reply) &&
+        parse_admin_name (args[0], suffix, &hash, reply)) {
+        g_string_append_printf (reply,
+                                "%u entries flushed\n",
+                                nss_tls_cache_remove_suffix (suffix));
+    }
+}
+
+static
+void
+dump_cache_entry (const int                         af,
+                  const struct nss_tls_cache_entry  *entry,
+                  gpointer                          user_data)
+{
+    GString *reply = user_data;
+    gchar addr[INET6_ADDRSTRLEN];
+    gint64 ttl;
+    guint8 i;
+
+    ttl = MAX (entry->expiry - g_get_monotonic_time (), 0) / 1000000;
+    g_string_append_printf (reply,
+                            "%s %s %"G_GINT64_FORMAT,
+                            entry->name->str,
+                            (af == AF_INET) ? "A" : "AAAA",
+                            ttl);
+
+    for (i = 0; i < entry->count; ++i) {
+        if (inet_ntop (af, &entry->addrs[i], addr, sizeof (addr))) {
+            g_string_append_printf (reply, " %s", addr);
+        }
+    }
+
+    if (entry->cname) {
+        g_string_append_printf (reply, " cname=%s", entry->cname->str);
+    }
+
+    g_string_append_c (reply, '\n');
+}
+
+static
+void
+admin_dump (gchar **args, GString *reply)
+{
+    if (check_admin_cache (reply)) {
+        nss_tls_cache_foreach (dump_cache_entry, reply);
+    }
+}
+
+static
+void
+admin_stats (gchar **args, GString *reply)
+{
+    get_stats (reply);
+}
+
+/* preloaded names are resolved like lookups from libnss_tls, without a client */
+static
+gboolean
+preload_name (const gchar *name, const int af)
+{
+    struct nss_tls_session *session;
+
+    session = g_new0 (struct nss_tls_session, 1);
+#ifndef NSS_TLS_GIO_FRONTEND
+    session->fd = -1;
+#endif
+    session->preload = TRUE;
+    session->request.af = af;
+    session->request.prio = NSS_TLS_PRIO_BACKGROUND;
+    session->response.expiry = -1;
+    session->ttl = -1;
+    session->accepted = g_get_monotonic_time ();
+
+    if ((g_strlcpy (session->request.name,
+                    name,
+                    sizeof (session->request.name)) >=
+         sizeof (session->request.name)) ||
+        !nss_tls_normalize_name (session->request.name, &session->hash) ||
+        nss_tls_is_suffixed (session->request.name) ||
+        is_server_domain (session->request.name)) {
+        free_session (session);
+        return FALSE;
+    }
+
+    if (!resolve_domain (session)) {
         stop_session (session);
     }
+
+    return TRUE;
 }
 
-/* step 3: we received the HTTPS response, parse it to construct our response
- * and send it to libnss_tls */
 static
 void
-on_response (GObject         *source_object,
-             GAsyncResult    *res,
-             gpointer        user_data)
+admin_preload (gchar **args, GString *reply)
 {
-    g_autoptr(GError) err = NULL;
-    struct nss_tls_session *session = (struct nss_tls_session *)user_data;
-    g_autoptr(GInputStream) in = NULL;
-    const char *type;
+    guint started = 0, skipped = 0;
+    gchar **name;
 
-    in = soup_session_send_finish (SOUP_SESSION (source_object),
-                                   res,
-                                   &err);
-    if (!in) {
-        if (err) {
-            g_warning ("Failed to query %s: %s",
-                       session->request.name,
-                       err->message);
+    if (!check_admin_cache (reply)) {
+        return;
+    }
+
+    for (name = args; *name; ++name) {
+        if (preload_name (*name, AF_INET) && preload_name (*name, AF_INET6)) {
+            started += 2;
+        } else {
+            ++skipped;
         }
-        else {
-            g_warning ("Failed to query %s", session->request.name);
+    }
+
+    g_string_append_printf (reply,
+                            "%u lookups started, %u names skipped\n",
+                            started,
+                            skipped);
+}
+
+static
+void
+admin_cache_size (gchar **args, GString *reply)
+{
+    guint64 size;
+    gchar *end;
+
+    if (!check_admin_cache (reply)) {
+        return;
+    }
+
+    size = g_ascii_strtoull (args[0], &end, 10);
+    if ((end == args[0]) ||
+        *end ||
+        (size < MIN_CACHE_SIZE) ||
+        (size > MAX_CACHE_SIZE)) {
+        g_string_append_printf (reply,
+                                "error: the cache size must be between %u "
+                                "and %u\n",
+                                MIN_CACHE_SIZE,
+                                MAX_CACHE_SIZE);
+        return;
+    }
+
+    cache_size = (guint)size;
+    nss_tls_cache_resize (cache_size);
+
+    g_debug ("Resizing the cache to %u entries", cache_size);
+    g_string_append_printf (reply, "cache size set to %u\n", cache_size);
+}
+
+static
+void
+admin_log_level (gchar **args, GString *reply)
+{
+    static const struct {
+        const gchar *name;
+        GLogLevelFlags level;
+    } levels[] = {
+        {"debug", G_LOG_LEVEL_DEBUG},
+        {"info", G_LOG_LEVEL_INFO},
+        {"message", G_LOG_LEVEL_MESSAGE},
+        {"warning", G_LOG_LEVEL_WARNING}
+    };
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS (levels); ++i) {
+        if (strcmp (args[0], levels[i].name) == 0) {
+            set_log_level (levels[i].level);
+            g_string_append_printf (reply,
+                                    "log level set to %s\n",
+                                    levels[i].name);
+            return;
         }
-        goto cleanup;
     }
 
-    if (!SOUP_STATUS_IS_SUCCESSFUL (session->message->status_code)) {
-        g_warning ("Failed to query %s: HTTP %d",
-                   session->request.name,
-                   session->message->status_code);
-        goto cleanup;
+    g_string_append_printf (reply, "error: bad log level: %s\n", args[0]);
+}
+
+static const struct nss_tls_admin_cmd admin_cmds[] = {
+    {"flush", 0, 1, admin_flush},
+    {"flush-suffix", 1, 1, admin_flush_suffix},
+    {"dump", 0, 0, admin_dump},
+    {"stats", 0, 0, admin_stats},
+    {"preload", 1, G_MAXUINT, admin_preload},
+    {"cache-size", 1, 1, admin_cache_size},
+    {"log-level", 1, 1, admin_log_level}
+};
+
+static
+void
+run_admin_cmd (gchar *line, GString *reply)
+{
+    g_auto(GStrv) args = NULL;
+    guint i, n = 0;
+    gchar **p;
+
+    /* we skip the empty strings between consecutive separators */
+    args = g_strsplit_set (g_strstrip (line), " \t", -1);
+    for (p = args; *p; ++p) {
+        if (**p) {
+            args[n++] = *p;
+        } else {
+            g_free (*p);
+        }
     }
+    args[n] = NULL;
 
-    type = soup_message_headers_get_content_type (
-        session->message->response_headers,
-        NULL
-    );
-    if (type && strcmp (type, "application/dns-message")) {
-        g_warning ("Bad response type for %s: %s",
-                   session->request.name,
-                   type);
-        goto cleanup;
+    if (n == 0) {
+        g_string_append (reply, "error: no command\n");
+        return;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS (admin_cmds); ++i) {
+        if (strcmp (args[0], admin_cmds[i].name) != 0) {
+            continue;
+        }
+
+        if ((n - 1 < admin_cmds[i].min_args) ||
+            (n - 1 > admin_cmds[i].max_args)) {
+            g_string_append_printf (reply,
+                                    "error: bad arguments for %s\n",
+                                    args[0]);
+            return;
+        }
+
+        g_debug ("Running admin command %s", args[0]);
+        admin_cmds[i].run (&args[1], reply);
+        return;
+    }
+
+    g_string_append_printf (reply, "error: unknown command: %s\n", args[0]);
+}
+
+static
+void
+on_admin_conn_closed (GObject       *source_object,
+                      GAsyncResult  *res,
+                      gpointer      user_data)
+{
+    struct nss_tls_admin_conn *conn = (struct nss_tls_admin_conn *)user_data;
+
+    g_io_stream_close_finish (G_IO_STREAM (source_object), res, NULL);
+
+    g_object_unref (conn->in);
+    g_object_unref (conn->connection);
+    g_string_free (conn->reply, TRUE);
+    g_free (conn);
+}
+
+static
+void
+stop_admin_conn (struct nss_tls_admin_conn *conn)
+{
+    g_io_stream_close_async (G_IO_STREAM (conn->connection),
+                             G_PRIORITY_DEFAULT,
+                             NULL,
+                             on_admin_conn_closed,
+                             conn);
+}
+
+static
+void
+on_admin_sent (GObject         *source_object,
+               GAsyncResult    *res,
+               gpointer        user_data)
+{
+    g_output_stream_write_all_finish (G_OUTPUT_STREAM (source_object),
+                                      res,
+                                      NULL,
+                                      NULL);
+
+    stop_admin_conn ((struct nss_tls_admin_conn *)user_data);
+}
+
+static
+void
+on_admin_cmd (GObject         *source_object,
+              GAsyncResult    *res,
+              gpointer        user_data)
+{
+    struct nss_tls_admin_conn *conn = (struct nss_tls_admin_conn *)user_data;
+    g_autofree gchar *line = NULL;
+    GOutputStream *out;
+
+    line = g_data_input_stream_read_line_finish (conn->in, res, NULL, NULL);
+    if (!line) {
+        stop_admin_conn (conn);
+        return;
     }
 
-    g_input_stream_read_all_async (in,
-                                   session->dns,
-                                   sizeof (session->dns),
-                                   G_PRIORITY_DEFAULT,
-                                   NULL,
-                                   on_body,
-                                   session);
+    run_admin_cmd (line, conn->reply);
 
-    g_object_unref (session->message);
+    out = g_io_stream_get_output_stream (G_IO_STREAM (conn->connection));
+    g_output_stream_write_all_async (out,
+                                     conn->reply->str,
+                                     conn->reply->len,
+                                     G_PRIORITY_DEFAULT,
+                                     NULL,
+                                     on_admin_sent,
+                                     conn);
+}
 
-    return;
+static
+void
+on_admin_connection (GSocketService     *service,
+                     GSocketConnection  *connection,
+                     GObject            *source_object,
+                     gpointer           user_data)
+{
+    struct nss_tls_admin_conn *conn;
+    struct ucred cred;
+    socklen_t len = sizeof (cred);
+    GSocket *s;
 
-cleanup:
-    g_object_unref (session->message);
+    s = g_socket_connection_get_socket (connection);
 
-    if (session->response.count == 0) {
-        stop_session (session);
+    /* only root and the user we run as may use the admin socket */
+    if ((getsockopt (g_socket_get_fd (s),
+                     SOL_SOCKET,
+                     SO_PEERCRED,
+                     &cred,
+                     &len) < 0) ||
+        ((cred.uid != 0) && (cred.uid != geteuid ()))) {
+        g_warning ("Rejected an admin connection");
+        return;
     }
+
+    g_socket_set_timeout (s, NSS_TLS_TIMEOUT);
+
+    conn = g_new0 (struct nss_tls_admin_conn, 1);
+    conn->connection = g_object_ref (connection);
+    conn->in = g_data_input_stream_new (
+        g_io_stream_get_input_stream (G_IO_STREAM (connection))
+    );
+    conn->reply = g_string_new (NULL);
+
+    g_data_input_stream_read_line_async (conn->in,
+                                         G_PRIORITY_DEFAULT,
+                                         NULL,
+                                         on_admin_cmd,
+                                         conn);
 }
 
-/*
- * we don't want to leak the local domain to the DoH server provider (for
- * example, it may indicate a router model) and we don't want to waste time on
- * this query if it's going to fail anyway
- */
 static
-gboolean
-is_suffixed (const gchar *name)
+GSocketService *
+listen_admin (const gchar *path)
 {
-    struct __res_state res;
-    gchar *suffix;
-    gboolean ret;
-    guint i;
+    GSocketService *s;
+    g_autoptr(GSocketAddress) sa = NULL;
+    g_autoptr(GError) err = NULL;
 
-    if (res_ninit (&res) < 0) {
-        return FALSE;
-    }
+    sa = g_unix_socket_address_new (path);
+    s = g_socket_service_new ();
 
-    for (i = 0; (i < G_N_ELEMENTS (res.dnsrch)) && res.dnsrch[i]; ++i) {
-        suffix = g_strconcat (".", res.dnsrch[i], NULL);
-        ret = g_str_has_suffix (name, suffix);
-        g_free (suffix);
-        if (ret) {
-            g_debug ("%s is suffixed by a local domain", name);
-            return ret;
-        }
+    if (!g_socket_listener_add_address (G_SOCKET_LISTENER (s),
+                                        sa,
+                                        G_SOCKET_TYPE_STREAM,
+                                        0,
+                                        NULL,
+                                        NULL,
+                                        &err)) {
+        g_warning ("Failed to listen on %s: %s", path, err->message);
+        g_object_unref (s);
+        return NULL;
     }
 
-    return FALSE;
+    g_signal_connect (s,
+                      "incoming",
+                      G_CALLBACK (on_admin_connection),
+                      NULL);
+    g_socket_service_start (s);
+
+    return s;
+}
+
+static
+void
+new_soup_session (void)
+{
+#ifdef NSS_TLS_DEBUG
+    SoupLogger *logger;
+#endif
+
+    soup = soup_session_new_with_options (SOUP_SESSION_TIMEOUT,
+                                          NSS_TLS_TIMEOUT,
+                                          SOUP_SESSION_IDLE_TIMEOUT,
+                                          NSS_TLS_IDLE_TIMEOUT,
+                                          NULL);
+    apply_pool_sizes ();
+#ifdef NSS_TLS_DEBUG
+    logger = soup_logger_new (SOUP_LOGGER_LOG_BODY, 128);
+    soup_session_add_feature (soup, SOUP_SESSION_FEATURE (logger));
+    g_object_unref (logger);
+#endif
 }
 
 /*
- * the DoH server addresses must be resolved by other means, otherwise this
- * results in infinite recursion
+ * after a network change, connections to DoH servers may be dead and their
+ * addresses may be different, so we start over: requests already sent through
+ * the old libsoup session complete or time out, while queries sent over native
+ * connections are retried over new ones
  */
 static
 gboolean
-is_server_domain (const gchar *name)
+on_network_settled (gpointer user_data)
 {
-    gint i;
+    struct nss_tls_resolver *resolver;
+    SoupSession *old = soup;
+    GList *l;
+    guint count, i;
+    gint j;
 
-    for (i = 0; i < nresolvers; ++i) {
-        if (strcmp (name, resolvers[i].domain) == 0) {
-            g_debug ("%s is a DoH server domain", name);
-            return TRUE;
-        }
-    }
+    network_timer = 0;
 
-    return FALSE;
-}
+    g_debug ("The network has changed, reconnecting");
 
-/* step 2: we received a request from libnss_tls and send a HTTPS request */
-static
-void
-on_request (GObject         *source_object,
-            GAsyncResult    *res,
-            gpointer        user_data)
-{
-    g_autoptr(GError) err = NULL;
-    struct nss_tls_session *session = user_data;
-    gsize len;
+    forget_host_addresses ();
 
-    if (!g_input_stream_read_all_finish (G_INPUT_STREAM (source_object),
-                                         res,
-                                         &len,
-                                         &err)) {
-        if (err) {
-            g_warning ("Failed to receive a request: %s", err->message);
-        }
-        else {
-            g_warning ("Failed to receive a request");
-        }
-        goto fail;
-    }
+    new_soup_session ();
+    g_object_unref (old);
 
-    if (len != sizeof (session->request)) {
-        g_debug ("Bad request");
-        goto fail;
+    /*
+     * queries are retried over new connections, at the end of the queue: we
+     * mark all old connections as closing first, so a query retried by
+     * stop_conn() is not sent over an old connection we haven't stopped yet
+     */
+    for (l = conns.head; l; l = l->next) {
+        ((struct nss_tls_conn *)l->data)->closing = TRUE;
     }
 
-    session->request.name[sizeof (session->request.name) - 1] = '\0';
+    for (count = conns.length; count > 0; --count) {
+        stop_conn (conns.head->data);
+    }
 
-    if (is_suffixed (session->request.name) ||
-        is_server_domain (session->request.name)) {
-        goto fail;
+    if (flush_on_network_change) {
+        nss_tls_cache_flush ();
     }
 
-    if (resolve_domain (session)) {
-        return;
+    /* we open new connections before the next lookup */
+    for (i = 0; i < resolvers->len; ++i) {
+        resolver = g_ptr_array_index (resolvers, i);
+        if (client == NSS_TLS_CLIENT_NATIVE) {
+            for (j = count_conns (resolver->url); j < min_conns; ++j) {
+                new_conn (resolver->url);
+            }
+        } else {
+            soup_session_prefetch_dns (soup,
+                                       resolver->domain,
+                                       NULL,
+                                       NULL,
+                                       NULL);
+        }
     }
 
-fail:
-    stop_session (session);
+    return G_SOURCE_REMOVE;
 }
 
-/* step 1: we accept a new connection from libnss_tls and wait for it to send a
- * request */
+/* a network change usually triggers a burst of notifications */
 static
 void
-on_connection (GSocketService     *service,
-               GSocketConnection  *connection,
-               GObject            *source_object,
-               gpointer           user_data)
+on_network_changed (GNetworkMonitor *monitor,
+                    gboolean        network_available,
+                    gpointer        user_data)
 {
-    GSocket *s;
-    struct nss_tls_session *session;
-    GInputStream *in;
-
-    /* we disconnect the client after NSS_TLS_TIMEOUT seconds */
-    s = g_socket_connection_get_socket (connection);
-    g_socket_set_timeout (s, NSS_TLS_TIMEOUT);
-
-    session = g_new0 (struct nss_tls_session, 1);
-    session->connection = g_object_ref (connection);
-    session->response.count = 0;
-    session->response.expiry = -1;
-
-    /* we assume the domain is not canonical */
-    session->canon = FALSE;
-
-    in = g_io_stream_get_input_stream (G_IO_STREAM (connection));
-    /* read the incoming request */
-    g_input_stream_read_all_async (in,
-                                   &session->request,
-                                   sizeof (session->request),
-                                   G_PRIORITY_DEFAULT,
-                                   NULL,
-                                   on_request,
-                                   session);
+    if (!network_timer) {
+        network_timer = g_timeout_add_seconds (NETWORK_CHANGE_DELAY,
+                                               on_network_settled,
+                                               NULL);
+    }
 }
 
 static
@@ -795,7 +5013,6 @@ on_cfg_changed (GFileMonitor        *monitor,
                 gpointer            user_data)
 {
     gboolean root = (gboolean)(gintptr)user_data;
-    gint pnresolvers = nresolvers, i;
 
     if ((event_type != G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT) &&
         (event_type != G_FILE_MONITOR_EVENT_DELETED)) {
@@ -810,14 +5027,8 @@ on_cfg_changed (GFileMonitor        *monitor,
         return;
     }
 
-    for (i = 0; i < pnresolvers; ++i) {
-        g_free (resolvers[i].url);
-    }
-
-    nresolvers -= pnresolvers;
-    memcpy (resolvers,
-            &resolvers[pnresolvers],
-            sizeof (resolvers[0]) * nresolvers);
+    apply_pool_sizes ();
+    publish_filter ();
 }
 
 static
@@ -841,16 +5052,105 @@ watch_cfg (const gchar      *path,
     }
 }
 
+/*
+ * a resolver that remains in the configuration keeps its connections, rate
+ * limits and statistics, even if its method changes
+ */
+static
+struct nss_tls_resolver *
+get_resolver (const gchar *url, const gchar *domain)
+{
+    struct nss_tls_resolver *resolver;
+    guint i;
+
+    for (i = 0; resolvers && (i < resolvers->len); ++i) {
+        resolver = g_ptr_array_index (resolvers, i);
+        if (strcmp (resolver->url, url) == 0) {
+            resolver->conns = CLAMP (resolver->conns, min_conns, max_conns);
+            resolver->tokens = MIN (resolver->tokens, burst);
+            return ref_resolver (resolver);
+        }
+    }
+
+    resolver = g_new0 (struct nss_tls_resolver, 1);
+    resolver->refs = 1;
+    resolver->url = g_strdup (url);
+    resolver->domain = g_ascii_strdown (domain, -1);
+    resolver->conns = min_conns;
+    resolver->tokens = burst;
+    resolver->refilled = g_get_monotonic_time ();
+
+    return resolver;
+}
+
+/* returns the default value if the key is missing or invalid */
+static
+gint
+get_cfg_int (GKeyFile       *cfg,
+             const gchar    *key,
+             const gint     def)
+{
+    g_autoptr(GError) err = NULL;
+    gint value;
+
+    value = g_key_file_get_integer (cfg, "global", key, &err);
+    if (err) {
+        if (!g_error_matches (err,
+                              G_KEY_FILE_ERROR,
+                              G_KEY_FILE_ERROR_KEY_NOT_FOUND) &&
+            !g_error_matches (err,
+                              G_KEY_FILE_ERROR,
+                              G_KEY_FILE_ERROR_GROUP_NOT_FOUND)) {
+            g_warning ("Bad %s: %s", key, err->message);
+        }
+        return def;
+    }
+
+    if (value <= 0) {
+        g_warning ("Bad %s: %d", key, value);
+        return def;
+    }
+
+    return value;
+}
+
+/* a resolver in the configuration being loaded */
+struct nss_tls_resolver_cfg {
+    const gchar *url;
+    gchar *domain;
+    enum nss_tls_methods method;
+};
+
+static
+void
+clear_resolver_cfg (gpointer data)
+{
+    g_free (((struct nss_tls_resolver_cfg *)data)->domain);
+}
+
+/*
+ * the configuration is applied only if it contains at least one valid
+ * resolver, so a bad edit does not leave a partially applied configuration
+ */
 static
 gboolean
 parse_cfg (const gboolean   root)
 {
     const gchar *dirs[3] = {NULL, NULL, NULL};
-    g_autofree gchar *user_dir = NULL;
-    gchar **list, **p, *path;
+    g_autofree gchar *user_dir = NULL, *value = NULL;
+    g_auto(GStrv) list = NULL;
+    gchar **p, *path;
     char *plus;
     g_autoptr(GKeyFile) cfg = NULL;
+    g_autoptr(GArray) cfgs = NULL;
+    g_autoptr(GPtrArray) next = NULL;
+    struct nss_tls_resolver_cfg rcfg;
+    struct nss_tls_resolver *resolver;
+    enum nss_tls_clients next_client = NSS_TLS_CLIENT_SOUP;
+    gint next_min_conns, next_max_conns, next_qps, next_burst;
+    gboolean next_flush;
     SoupURI *uri;
+    guint i;
 
     if (root) {
         dirs[0] = NSS_TLS_SYSCONFDIR;
@@ -882,6 +5182,35 @@ parse_cfg (const gboolean   root)
 
     g_key_file_set_list_separator (cfg, ',');
 
+    value = g_key_file_get_string (cfg, "global", "client", NULL);
+    if (value && (strcmp (value, "native") == 0)) {
+        next_client = NSS_TLS_CLIENT_NATIVE;
+    } else if (value && strcmp (value, "libsoup")) {
+        g_warning ("Unknown client: %s", value);
+        next_client = client;
+    }
+
+    next_min_conns = get_cfg_int (cfg,
+                                  "min_connections",
+                                  MIN_CONNS_PER_RESOLVER);
+    next_max_conns = get_cfg_int (cfg,
+                                  "max_connections",
+                                  MAX_CONNS_PER_RESOLVER);
+    if (next_max_conns < next_min_conns) {
+        g_warning ("max_connections is smaller than min_connections");
+        next_max_conns = next_min_conns;
+    }
+
+    /* by default, we don't limit the query rate */
+    next_qps = get_cfg_int (cfg, "qps", 0);
+    next_burst = get_cfg_int (cfg, "burst", next_qps);
+
+    /* cached addresses may depend on the network (split-horizon DNS) */
+    next_flush = g_key_file_get_boolean (cfg,
+                                         "global",
+                                         "flush_on_network_change",
+                                         NULL);
+
     list = g_key_file_get_string_list (cfg,
                                        "global",
                                        "resolvers",
@@ -891,7 +5220,10 @@ parse_cfg (const gboolean   root)
         return FALSE;
     }
 
-    for (p = list; *p && (nresolvers < G_N_ELEMENTS (resolvers)); ++p) {
+    cfgs = g_array_new (FALSE, FALSE, sizeof (struct nss_tls_resolver_cfg));
+    g_array_set_clear_func (cfgs, clear_resolver_cfg);
+
+    for (p = list; *p; ++p) {
         plus = strchr (*p, '+');
         if (plus) {
             *plus = '\0';
@@ -901,33 +5233,71 @@ parse_cfg (const gboolean   root)
         uri = soup_uri_new (*p);
         if (!uri) {
             g_warning ("Bad resolver: %s", *p);
-            g_free (*p);
             continue;
         }
 
-        resolvers[nresolvers].url = *p;
-        resolvers[nresolvers].domain = soup_uri_get_host (uri);
-        resolvers[nresolvers].method = NSS_TLS_METHOD_POST;
+        /* both clients speak only DNS over HTTPS */
+        if ((uri->scheme != SOUP_URI_SCHEME_HTTPS) &&
+            (uri->scheme != SOUP_URI_SCHEME_HTTP)) {
+            g_warning ("Unsupported resolver protocol: %s", *p);
+            soup_uri_free (uri);
+            continue;
+        }
+
+        rcfg.url = *p;
+        rcfg.domain = g_strdup (soup_uri_get_host (uri));
+        soup_uri_free (uri);
 
+        rcfg.method = NSS_TLS_METHOD_POST;
         if (plus) {
             if (strcmp (plus, "get") == 0) {
-                resolvers[nresolvers].method = NSS_TLS_METHOD_GET;
+                rcfg.method = NSS_TLS_METHOD_GET;
             } else if (strcmp (plus, "random") == 0) {
-                resolvers[nresolvers].method = NSS_TLS_METHOD_RANDOM;
+                rcfg.method = NSS_TLS_METHOD_RANDOM;
+            } else if (strcmp (plus, "auto") == 0) {
+                rcfg.method = NSS_TLS_METHOD_AUTO;
             } else if (strcmp (plus, "post")) {
                 g_warning ("Unknown resolving method: %s", plus);
             }
         }
 
-        ++nresolvers;
+        g_array_append_val (cfgs, rcfg);
     }
 
-    g_free (list);
-
-    if (nresolvers == 0) {
+    if (cfgs->len == 0) {
         return FALSE;
     }
 
+    /* from here on, we apply the new configuration */
+    client = next_client;
+    min_conns = next_min_conns;
+    max_conns = next_max_conns;
+    qps = next_qps;
+    burst = next_burst;
+    flush_on_network_change = next_flush;
+
+    set_bootstrap_addresses (cfg);
+
+    next = g_ptr_array_new_with_free_func (unref_resolver);
+
+    for (i = 0; i < cfgs->len; ++i) {
+        rcfg = g_array_index (cfgs, struct nss_tls_resolver_cfg, i);
+        resolver = get_resolver (rcfg.url, rcfg.domain);
+        resolver->method = rcfg.method;
+        g_ptr_array_add (next, resolver);
+    }
+
+    /*
+     * queries sent to resolvers that were removed hold a reference to them
+     * until they finish
+     */
+    if (resolvers) {
+        g_ptr_array_unref (resolvers);
+    }
+    resolvers = g_steal_pointer (&next);
+
+    check_bootstrap_addresses ();
+
     watch_cfg (path, root);
 
     return TRUE;
@@ -935,6 +5305,24 @@ parse_cfg (const gboolean   root)
 
 static GOptionEntry opts[] = {
     {"cache", 'c', 0, G_OPTION_ARG_NONE, &cache, "Cache responses", NULL},
+    {
+        "listen",
+        'l',
+        0,
+        G_OPTION_ARG_STRING,
+        &listen_addr,
+        "Accept DNS queries on ADDRESS",
+        "ADDRESS"
+    },
+    {
+        "query-log",
+        'q',
+        0,
+        G_OPTION_ARG_FILENAME,
+        &query_log_path,
+        "Append a record of each lookup to FILE",
+        "FILE"
+    },
     {
         "random",
         'r',
@@ -969,16 +5357,19 @@ main (int    argc,
 {
     static char root_socket[] = NSS_TLS_SOCKET_PATH;
     GMainLoop *loop;
-    GSocketService *s;
-    GSocketAddress *sa;
+#ifdef NSS_TLS_GIO_FRONTEND
+    GObject *s;
+#else
+    int s;
+#endif
+    GSocketService *stub_tcp = NULL, *admin;
+    GSocket *stub_udp = NULL;
     const gchar *runtime_dir;
     struct passwd *user;
     gchar *user_socket = root_socket;
-#ifdef NSS_TLS_DEBUG
-    static SoupLogger *logger;
-#endif
+    gchar *filter_path, *admin_socket;
+    GResolver *resolver;
     int mode = 0600;
-    gint i;
     uid_t uid;
     gid_t gid;
     gboolean root;
@@ -987,6 +5378,17 @@ main (int    argc,
         return EXIT_FAILURE;
     }
 
+    g_log_set_default_handler (on_log, NULL);
+
+    if (listen_addr && !listen_stub (listen_addr, &stub_udp, &stub_tcp)) {
+        return EXIT_FAILURE;
+    }
+
+    /* the log is opened before we drop privileges */
+    if (query_log_path && !open_query_log (query_log_path)) {
+        return EXIT_FAILURE;
+    }
+
     root = (geteuid () == 0);
     if (root) {
         user = getpwnam (NSS_TLS_USER);
@@ -1011,6 +5413,12 @@ main (int    argc,
         }
 
         mode = 0666;
+        filter_path = g_build_filename (NSS_TLS_SOCKET_DIR,
+                                        NSS_TLS_FILTER_NAME,
+                                        NULL);
+        admin_socket = g_build_filename (NSS_TLS_SOCKET_DIR,
+                                         NSS_TLS_ADMIN_SOCKET_NAME,
+                                         NULL);
     } else {
         runtime_dir = g_get_user_runtime_dir ();
         if (!runtime_dir) {
@@ -1021,96 +5429,130 @@ main (int    argc,
                                     runtime_dir,
                                     NSS_TLS_SOCKET_NAME,
                                     NULL);
+        filter_path = g_build_filename (runtime_dir,
+                                        NSS_TLS_FILTER_NAME,
+                                        NULL);
+        admin_socket = g_build_filename (runtime_dir,
+                                         NSS_TLS_ADMIN_SOCKET_NAME,
+                                         NULL);
     }
 
+    hosts = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, free_host);
+
     if (!parse_cfg (root)) {
         return EXIT_FAILURE;
     }
 
+    resolver = g_object_new (NSS_TLS_TYPE_RESOLVER, NULL);
+    g_resolver_set_default (resolver);
+
     if (root && cache) {
         g_warning ("Enabling cache when running as root may harm privacy");
     }
 
-    if (randomize && (nresolvers > 1)) {
+    if (randomize && (resolvers->len > 1)) {
         g_warning ("Disabling deterministic server choice may harm privacy");
     }
 
     if (cache) {
-        for (i = 0; i < G_N_ELEMENTS (caches); ++i) {
-            caches[i] = g_hash_table_new_full (g_str_hash,
-                                               g_str_equal,
-                                               g_free,
-                                               g_free);
-        }
+        nss_tls_cache_init (cache_size,
+                            NSS_TLS_CACHE_TINYLFU,
+                            NSS_TLS_CACHE_MIN_TTL,
+                            NSS_TLS_CACHE_FALLBACK_TTL);
     }
 
     g_unlink (user_socket);
-    sa = g_unix_socket_address_new (user_socket);
-    s = g_socket_service_new ();
     loop = g_main_loop_new (NULL, FALSE);
 
     if (cache) {
-        g_timeout_add_seconds (CACHE_CLEANUP_INTERVAL,
+        g_timeout_add_seconds (NSS_TLS_CACHE_CLEANUP_INTERVAL,
                                on_cache_cleanup,
                                NULL);
+        watch_memory_pressure ();
     }
 
-    soup = soup_session_new_with_options (SOUP_SESSION_TIMEOUT,
-                                          NSS_TLS_TIMEOUT,
-                                          SOUP_SESSION_IDLE_TIMEOUT,
-                                          NSS_TLS_TIMEOUT,
-                                          SOUP_SESSION_MAX_CONNS_PER_HOST,
-                                          MAX_CONNS_PER_RESOLVER,
-                                          SOUP_SESSION_MAX_CONNS,
-                                          MAX_CONNS_PER_RESOLVER * nresolvers,
-                                          NULL);
-#ifdef NSS_TLS_DEBUG
-    logger = soup_logger_new (SOUP_LOGGER_LOG_BODY, 128);
-    soup_session_add_feature (soup, SOUP_SESSION_FEATURE (logger));
-#endif
+    g_timeout_add_seconds (1, on_conn_timeout, NULL);
+    g_timeout_add_seconds (POOL_RESIZE_INTERVAL, on_pool_resize, NULL);
 
-    g_socket_listener_add_address (G_SOCKET_LISTENER (s),
-                                   sa,
-                                   G_SOCKET_TYPE_STREAM,
-                                   0,
-                                   NULL,
-                                   NULL,
-                                   NULL);
+    new_soup_session ();
 
-    g_signal_connect (s,
-                      "incoming",
-                      G_CALLBACK (on_connection),
+    g_signal_connect (g_network_monitor_get_default (),
+                      "network-changed",
+                      G_CALLBACK (on_network_changed),
                       NULL);
-    g_socket_service_start (s);
+
+    s = listen_clients (user_socket);
+#ifdef NSS_TLS_GIO_FRONTEND
+    if (!s) {
+#else
+    if (s < 0) {
+#endif
+        return EXIT_FAILURE;
+    }
     g_chmod (user_socket , mode);
 
+    g_unlink (admin_socket);
+    admin = listen_admin (admin_socket);
+    if (!admin) {
+        return EXIT_FAILURE;
+    }
+    g_chmod (admin_socket, 0600);
+
+    open_filter (filter_path);
+
+    if (stub_tcp) {
+        g_socket_service_start (stub_tcp);
+    }
+
     g_unix_signal_add (SIGINT, on_term, loop);
     g_unix_signal_add (SIGTERM, on_term, loop);
+    g_unix_signal_add (SIGUSR1, on_dump_stats, NULL);
 
     g_main_loop_run (loop);
 
-    for (i = 0; i < nresolvers; ++i) {
-        g_free (resolvers[i].url);
-    }
+    close_query_log ();
+
+    g_ptr_array_unref (resolvers);
 
     g_main_loop_unref (loop);
+#ifdef NSS_TLS_GIO_FRONTEND
     g_object_unref (s);
+#else
+    close (s);
+#endif
+    if (stub_tcp) {
+        g_object_unref (stub_tcp);
+        g_object_unref (stub_udp);
+    }
     g_unlink (user_socket);
     if (user_socket != root_socket) {
         g_free (user_socket);
     }
-    g_object_unref (sa);
+
+    g_object_unref (admin);
+    g_unlink (admin_socket);
+    g_free (admin_socket);
+
+    /* libnss_tls stops using the filter once the file is deleted */
+    if (filter) {
+        g_unlink (filter_path);
+        munmap (filter, sizeof (*filter));
+        if (resolv_monitor) {
+            g_object_unref (resolv_monitor);
+        }
+    }
+    g_free (filter_path);
+
+    g_object_unref (resolver);
+    g_hash_table_unref (hosts);
+    g_object_unref (soup);
 
     if (cfg_monitor) {
         g_object_unref (cfg_monitor);
         g_object_unref (cfg_file);
     }
 
-    if (cache) {
-        for (i = G_N_ELEMENTS (caches) - 1; i >= 0; --i) {
-            g_hash_table_unref (caches[i]);
-        }
-    }
+    nss_tls_cache_free ();
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,399 @@
+/*
+ * This file is part of nss-tls.
+ *
+ * Copyright (C) 2019  Dima Krasner
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include <glib.h>
+
+#include "nss-tls.h"
+#include "nss-tlsd-cache.h"
+
+/*
+ * tlscachesim replays a query log through the cache of nss-tlsd, in virtual
+ * time: the clock advances to the time of each lookup, and expired entries are
+ * removed every NSS_TLS_CACHE_CLEANUP_INTERVAL seconds, like in nss-tlsd
+ */
+struct lookup {
+    gint64 time;
+    const gchar *name;
+    guint hash;
+    gint af;
+    gint64 ttl;
+    guint8 count;
+    gboolean failed;
+};
+
+struct result {
+    guint hits;
+    guint misses;
+    gsize memory;
+};
+
+static gchar *sizes = "256,1024,4096,16384";
+static gchar *policies = "tinylfu,lru";
+static gchar *min_ttls = NULL;
+static gint fallback_ttl = NSS_TLS_CACHE_FALLBACK_TTL;
+static gboolean check = FALSE;
+
+static GOptionEntry opts[] = {
+    {
+        "sizes",
+        's',
+        0,
+        G_OPTION_ARG_STRING,
+        &sizes,
+        "Simulate caches of SIZES entries",
+        "SIZES"
+    },
+    {
+        "policies",
+        'p',
+        0,
+        G_OPTION_ARG_STRING,
+        &policies,
+        "Simulate eviction POLICIES (tinylfu or lru)",
+        "POLICIES"
+    },
+    {
+        "min-ttls",
+        'm',
+        0,
+        G_OPTION_ARG_STRING,
+        &min_ttls,
+        "Simulate minimum TTLS, in seconds",
+        "TTLS"
+    },
+    {
+        "fallback-ttl",
+        'f',
+        0,
+        G_OPTION_ARG_INT,
+        &fallback_ttl,
+        "Cache responses without addresses for TTL seconds",
+        "TTL"
+    },
+    {
+        "check",
+        'c',
+        0,
+        G_OPTION_ARG_NONE,
+        &check,
+        "Fail unless the first policy has the highest hit ratio",
+        NULL
+    },
+    {NULL}
+};
+
+static
+gboolean
+load_log (const gchar   *path,
+          GArray        *lookups,
+          GStringChunk  *names)
+{
+    g_autofree gchar *buf = NULL;
+    const struct nss_tls_log_header *header;
+    struct nss_tls_log_entry entry;
+    struct lookup lookup;
+    gchar name[G_MAXUINT8 + 1];
+    gsize len, off;
+
+    if (!g_file_get_contents (path, &buf, &len, NULL)) {
+        g_printerr ("Failed to read %s\n", path);
+        return FALSE;
+    }
+
+    header = (const struct nss_tls_log_header *)buf;
+    if ((len < sizeof (*header)) ||
+        (header->magic != NSS_TLS_LOG_MAGIC) ||
+        (header->version != NSS_TLS_LOG_VERSION)) {
+        g_printerr ("%s is not a query log\n", path);
+        return FALSE;
+    }
+
+    for (off = sizeof (*header); off + sizeof (entry) <= len; ) {
+        memcpy (&entry, buf + off, sizeof (entry));
+        off += sizeof (entry);
+
+        if (off + entry.name_len + entry.server_len > len) {
+            g_printerr ("%s is truncated\n", path);
+            break;
+        }
+
+        memcpy (name, buf + off, entry.name_len);
+        name[entry.name_len] = '\0';
+        off += entry.name_len + entry.server_len;
+
+        /* queries forwarded as-is by the DNS stub are not cached */
+        if (((entry.af != AF_INET) && (entry.af != AF_INET6)) ||
+            !nss_tls_normalize_name (name, &lookup.hash)) {
+            continue;
+        }
+
+        /* records are written when lookups complete */
+        lookup.time = entry.time - entry.latency;
+        lookup.name = g_string_chunk_insert_const (names, name);
+        lookup.af = entry.af;
+        lookup.ttl = (entry.ttl == NSS_TLS_LOG_NO_TTL) ? -1 : entry.ttl;
+        lookup.count = MIN (entry.count, NSS_TLS_ADDRS_MAX);
+        lookup.failed = (entry.result == NSS_TLS_LOG_FAILED);
+        g_array_append_val (lookups, lookup);
+    }
+
+    return TRUE;
+}
+
+static
+gint
+compare_lookups (gconstpointer a, gconstpointer b)
+{
+    const struct lookup *la = a, *lb = b;
+
+    return (la->time > lb->time) - (la->time < lb->time);
+}
+
+static
+void
+simulate (const GArray                      *lookups,
+          const guint                       size,
+          const enum nss_tls_cache_policy   policy,
+          const gint64                      min_ttl,
+          struct result                     *result)
+{
+    const struct lookup *lookup;
+    struct nss_tls_res res = {.cname = ""};
+    gint64 cleanup;
+    guint i;
+
+    memset (result, 0, sizeof (*result));
+
+    nss_tls_cache_init (size, policy, min_ttl, fallback_ttl);
+
+    cleanup = g_array_index (lookups, struct lookup, 0).time +
+              NSS_TLS_CACHE_CLEANUP_INTERVAL * 1000000;
+
+    for (i = 0; i < lookups->len; ++i) {
+        lookup = &g_array_index (lookups, struct lookup, i);
+
+        for (; cleanup <= lookup->time;
+             cleanup += NSS_TLS_CACHE_CLEANUP_INTERVAL * 1000000) {
+            nss_tls_cache_expire (cleanup);
+        }
+
+        nss_tls_cache_count_lookup (lookup->hash);
+
+        if (nss_tls_cache_query (lookup->af,
+                                 nss_tls_find_name (lookup->name,
+                                                    lookup->hash))) {
+            ++result->hits;
+            continue;
+        }
+
+        ++result->misses;
+
+        /* nss-tlsd does not cache failed lookups */
+        if (lookup->failed) {
+            continue;
+        }
+
+        res.count = lookup->count;
+        res.expiry = -1;
+        if (lookup->count > 0) {
+            res.expiry = nss_tls_cache_get_expiry (lookup->ttl, lookup->time);
+        }
+
+        nss_tls_cache_add (lookup->af,
+                           lookup->name,
+                           lookup->hash,
+                           &res,
+                           lookup->ttl,
+                           FALSE,
+                           lookup->time);
+
+        result->memory = MAX (result->memory, nss_tls_cache_get_memory ());
+    }
+
+    nss_tls_cache_free ();
+}
+
+/* returns NULL if a value is not a number, or smaller than min */
+static
+GArray *
+parse_list (const gchar *list, const guint64 min)
+{
+    g_auto(GStrv) values = NULL;
+    GArray *array;
+    gchar **p, *end;
+    guint64 value;
+
+    array = g_array_new (FALSE, FALSE, sizeof (guint));
+    values = g_strsplit (list, ",", -1);
+
+    for (p = values; *p; ++p) {
+        value = g_ascii_strtoull (*p, &end, 10);
+        if ((end == *p) || *end || (value < min) || (value > G_MAXINT)) {
+            g_printerr ("Bad value: %s\n", *p);
+            g_array_free (array, TRUE);
+            return NULL;
+        }
+
+        g_array_append_val (array, (guint){value});
+    }
+
+    return array;
+}
+
+int
+main (int    argc,
+      char   **argv)
+{
+    g_autoptr(GOptionContext) ctx = NULL;
+    g_autoptr(GArray) lookups = NULL, size_list = NULL, ttl_list = NULL;
+    g_autoptr(GArray) first_hits = NULL;
+    g_auto(GStrv) policy_list = NULL;
+    GStringChunk *names;
+    struct result result;
+    enum nss_tls_cache_policy policy;
+    gint64 duration;
+    guint i, j, k, hits;
+    gchar **p;
+    gboolean passed = TRUE;
+    int ret = EXIT_FAILURE;
+
+    ctx = g_option_context_new ("LOG");
+    g_option_context_set_summary (ctx,
+                                  "Replay a query log written by nss-tlsd "
+                                  "through caches of different sizes and "
+                                  "policies.");
+    g_option_context_add_main_entries (ctx, opts, NULL);
+    if (!g_option_context_parse (ctx, &argc, &argv, NULL) || (argc != 2)) {
+        g_printerr ("%s", g_option_context_get_help (ctx, TRUE, NULL));
+        return EXIT_FAILURE;
+    }
+
+    size_list = parse_list (sizes, 1);
+    if (!size_list) {
+        return EXIT_FAILURE;
+    }
+
+    if (min_ttls) {
+        ttl_list = parse_list (min_ttls, 0);
+    } else {
+        ttl_list = parse_list (G_STRINGIFY (NSS_TLS_CACHE_MIN_TTL), 0);
+    }
+    if (!ttl_list) {
+        return EXIT_FAILURE;
+    }
+
+    policy_list = g_strsplit (policies, ",", -1);
+    for (p = policy_list; *p; ++p) {
+        if (strcmp (*p, "tinylfu") && strcmp (*p, "lru")) {
+            g_printerr ("Unknown policy: %s\n", *p);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* with --check, we keep the hit count of the first policy for each run */
+    first_hits = g_array_sized_new (FALSE,
+                                    FALSE,
+                                    sizeof (guint),
+                                    size_list->len * ttl_list->len);
+
+    lookups = g_array_new (FALSE, FALSE, sizeof (struct lookup));
+    names = g_string_chunk_new (4096);
+
+    if (!load_log (argv[1], lookups, names)) {
+        goto out;
+    }
+
+    if (lookups->len == 0) {
+        g_printerr ("%s contains no lookups\n", argv[1]);
+        goto out;
+    }
+
+    /* records are in the order lookups completed, not started */
+    g_array_sort (lookups, compare_lookups);
+
+    duration = g_array_index (lookups, struct lookup, lookups->len - 1).time -
+               g_array_index (lookups, struct lookup, 0).time;
+    duration = MAX (duration, 1000000);
+
+    g_print ("%u lookups over %"G_GINT64_FORMAT" seconds\n\n",
+             lookups->len,
+             duration / 1000000);
+    g_print ("%-8s %8s %8s %8s %12s %12s\n",
+             "policy",
+             "size",
+             "min_ttl",
+             "hit%",
+             "upstream/s",
+             "memory_kib");
+
+    for (p = policy_list; *p; ++p) {
+        policy = strcmp (*p, "lru") ? NSS_TLS_CACHE_TINYLFU : NSS_TLS_CACHE_LRU;
+
+        for (i = 0; i < size_list->len; ++i) {
+            for (j = 0; j < ttl_list->len; ++j) {
+                k = g_array_index (ttl_list, guint, j);
+                simulate (lookups,
+                          g_array_index (size_list, guint, i),
+                          policy,
+                          k,
+                          &result);
+
+                g_print ("%-8s %8u %8u %8.2f %12.2f %12"G_GSIZE_FORMAT"\n",
+                         *p,
+                         g_array_index (size_list, guint, i),
+                         k,
+                         100.0 * result.hits / lookups->len,
+                         (gdouble)result.misses * 1000000 / duration,
+                         result.memory / 1024);
+
+                if (p == policy_list) {
+                    g_array_append_val (first_hits, result.hits);
+                    continue;
+                }
+
+                hits = g_array_index (first_hits,
+                                      guint,
+                                      i * ttl_list->len + j);
+                if (check && (result.hits >= hits)) {
+                    g_printerr ("%s is not better than %s with size %u "
+                                "and minimum TTL %u\n",
+                                policy_list[0],
+                                *p,
+                                g_array_index (size_list, guint, i),
+                                k);
+                    passed = FALSE;
+                }
+            }
+        }
+    }
+
+    if (passed) {
+        ret = EXIT_SUCCESS;
+    }
+
+out:
+    g_string_chunk_free (names);
+    return ret;
+}
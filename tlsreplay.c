@@ -0,0 +1,284 @@
+/*
+ * This file is part of nss-tls.
+ *
+ * Copyright (C) 2019  Dima Krasner
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "nss-tls.h"
+#include "nss-tls-async.h"
+
+#define MAX_INFLIGHT 256
+#define REAP_MAX 64
+
+struct replay {
+    struct nss_tls_async *ctx;
+    int64_t *sent;
+    int64_t *latencies;
+    size_t count;
+    size_t size;
+    unsigned int inflight;
+    unsigned int found;
+    unsigned int notfound;
+    unsigned int failed;
+};
+
+static int64_t get_time(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* returns 1 if a record was read, 0 at the end of the log or -1 on error */
+static int read_entry(FILE *fp, struct nss_tls_log_entry *entry, char *name)
+{
+    char server[UINT8_MAX];
+
+    if (fread(entry, sizeof(*entry), 1, fp) != 1)
+        return feof(fp) ? 0 : -1;
+
+    if ((fread(name, 1, entry->name_len, fp) != entry->name_len) ||
+        (fread(server, 1, entry->server_len, fp) != entry->server_len))
+        return -1;
+
+    name[entry->name_len] = '\0';
+    return 1;
+}
+
+static int submit(struct replay *replay, const char *name, int af)
+{
+    int64_t *sent, *latencies;
+    size_t size;
+
+    if (replay->count == replay->size) {
+        size = replay->size ? replay->size * 2 : 1024;
+
+        sent = realloc(replay->sent, size * sizeof(*sent));
+        if (!sent)
+            return -1;
+        replay->sent = sent;
+
+        latencies = realloc(replay->latencies, size * sizeof(*latencies));
+        if (!latencies)
+            return -1;
+        replay->latencies = latencies;
+
+        replay->size = size;
+    }
+
+    replay->sent[replay->count] = get_time();
+
+    if (nss_tls_async_submit(replay->ctx, name, af, replay->count) < 0) {
+        ++replay->failed;
+        replay->sent[replay->count] = -1;
+    } else
+        ++replay->inflight;
+
+    ++replay->count;
+    return 0;
+}
+
+static int reap(struct replay *replay)
+{
+    struct nss_tls_async_result results[REAP_MAX];
+    int64_t now;
+    int n, i;
+
+    n = nss_tls_async_reap(replay->ctx, results, REAP_MAX);
+    if (n < 0)
+        return -1;
+
+    now = get_time();
+
+    for (i = 0; i < n; ++i) {
+        replay->latencies[results[i].id] = now - replay->sent[results[i].id];
+        --replay->inflight;
+
+        switch (results[i].error) {
+        case 0:
+            ++replay->found;
+            break;
+
+        case ENOENT:
+            ++replay->notfound;
+            break;
+
+        default:
+            ++replay->failed;
+        }
+    }
+
+    return 0;
+}
+
+static int compare_latencies(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void print_stats(struct replay *replay)
+{
+    size_t i, n = 0;
+
+    /* lookups that could not be submitted have no latency */
+    for (i = 0; i < replay->count; ++i) {
+        if (replay->sent[i] >= 0)
+            replay->latencies[n++] = replay->latencies[i];
+    }
+
+    printf("%zu lookups: %u found, %u not found, %u failed\n",
+           replay->count,
+           replay->found,
+           replay->notfound,
+           replay->failed);
+
+    if (n == 0)
+        return;
+
+    qsort(replay->latencies, n, sizeof(replay->latencies[0]), compare_latencies);
+
+    printf("latency (us): p50 %"PRId64", p90 %"PRId64", p99 %"PRId64", "
+           "max %"PRId64"\n",
+           replay->latencies[n / 2],
+           replay->latencies[n * 9 / 10],
+           replay->latencies[n * 99 / 100],
+           replay->latencies[n - 1]);
+}
+
+int main(int argc, char *argv[])
+{
+    struct nss_tls_log_header header;
+    struct nss_tls_log_entry entry;
+    struct replay replay = {0};
+    struct pollfd pfd = {.events = POLLIN};
+    char name[UINT8_MAX + 1];
+    FILE *fp;
+    double speed = 1;
+    int64_t first = -1, start, due, now;
+    int opt, next, timeout, ret = EXIT_FAILURE;
+
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        switch (opt) {
+        case 's':
+            speed = strtod(optarg, NULL);
+            if (speed >= 0)
+                break;
+            /* fall through */
+
+        default:
+            optind = argc;
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr,
+                "Usage: tlsreplay [-s SPEED] LOG\n"
+                "Replay a query log written by nss-tlsd through libnss_tls.\n"
+                "SPEED multiplies the original query rate; with 0, lookups "
+                "are sent as fast as possible.\n");
+        return EXIT_FAILURE;
+    }
+
+    fp = fopen(argv[optind], "rb");
+    if (!fp)
+        return EXIT_FAILURE;
+
+    if ((fread(&header, sizeof(header), 1, fp) != 1) ||
+        (header.magic != NSS_TLS_LOG_MAGIC) ||
+        (header.version != NSS_TLS_LOG_VERSION)) {
+        fprintf(stderr, "%s is not a query log\n", argv[optind]);
+        goto close_log;
+    }
+
+    replay.ctx = nss_tls_async_new();
+    if (!replay.ctx)
+        goto close_log;
+    pfd.fd = nss_tls_async_fd(replay.ctx);
+
+    start = get_time();
+    next = read_entry(fp, &entry, name);
+
+    while ((next > 0) || (replay.inflight > 0)) {
+        now = get_time();
+        timeout = -1;
+
+        while ((next > 0) && (replay.inflight < MAX_INFLIGHT)) {
+            /* queries forwarded as-is by the DNS stub cannot be replayed */
+            if ((entry.af != AF_INET) && (entry.af != AF_INET6)) {
+                next = read_entry(fp, &entry, name);
+                continue;
+            }
+
+            /* records are written when lookups complete */
+            if (first < 0)
+                first = entry.time - entry.latency;
+
+            due = start;
+            if (speed > 0)
+                due += (int64_t)((entry.time - entry.latency - first) / speed);
+
+            if (due > now) {
+                timeout = (int)((due - now + 999) / 1000);
+                break;
+            }
+
+            if (submit(&replay, name, entry.af) < 0)
+                goto free_ctx;
+
+            next = read_entry(fp, &entry, name);
+        }
+
+        /* the log may be truncated if nss-tlsd is still writing it */
+        if (next < 0) {
+            fprintf(stderr, "%s is truncated\n", argv[optind]);
+            next = 0;
+        }
+
+        if ((next == 0) && (replay.inflight == 0))
+            break;
+
+        if ((poll(&pfd, 1, timeout) < 0) && (errno != EINTR))
+            goto free_ctx;
+
+        if (reap(&replay) < 0)
+            goto free_ctx;
+    }
+
+    print_stats(&replay);
+    ret = EXIT_SUCCESS;
+
+free_ctx:
+    nss_tls_async_free(replay.ctx);
+    free(replay.latencies);
+    free(replay.sent);
+
+close_log:
+    fclose(fp);
+    return ret;
+}